@@ -0,0 +1,450 @@
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "bridge_simulator.h"
+#include "logging.h"
+
+static const char promptLogin[] = "login: ";
+static const char promptPassword[] = "password: ";
+static const char promptCommand[] = "GNET> ";
+
+// integration protocol error codes
+static const int errParameterCount = 1;
+static const int errNoObject = 2;
+static const int errInvalidAction = 3;
+static const int errOutOfRange = 4;
+static const int errUnsupported = 6;
+
+// telnet command bytes
+static const uint8_t telnetSE = 240;
+static const uint8_t telnetSB = 250;
+static const uint8_t telnetWILL = 251;
+static const uint8_t telnetIAC = 255;
+
+BridgeSimulator::BridgeSimulator(EventLoop *evloop, const options &o) :
+    opts(o)
+{
+    loop = evloop;
+    listenfd = -1;
+    seed = o.seed;
+    timerButton = 0;
+    buttonDevice = -1;
+    buttonNumber = 0;
+    commands = 0;
+}
+
+BridgeSimulator::~BridgeSimulator() {
+    stop();
+}
+
+void BridgeSimulator::addZone(int id, bool dimmer) {
+    zones[id] = {0, dimmer};
+}
+
+void BridgeSimulator::addKeypad(int id) {
+    keypads.push_back(id);
+}
+
+bool BridgeSimulator::start() {
+    listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(listenfd < 0) {
+        log_error("failed to create socket");
+        return false;
+    }
+
+    int one = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons((uint16_t)opts.port);
+    if(::bind(listenfd, (const sockaddr *) &addr, sizeof(addr)) < 0 || ::listen(listenfd, 16) < 0) {
+        log_error("failed to listen on port %d: %s", opts.port, strerror(errno));
+        ::close(listenfd);
+        listenfd = -1;
+        return false;
+    }
+
+    if(!loop->addHandler(listenfd, EPOLLIN, onAccept, this)) {
+        return false;
+    }
+
+    if(opts.buttonInterval > 0 && !keypads.empty()) {
+        timerButton = loop->addTimer(opts.buttonInterval, onButton, this);
+    }
+
+    log_notice("simulated bridge listening on port %d with %ld zones and %ld keypads",
+               opts.port, zones.size(), keypads.size());
+    return true;
+}
+
+void BridgeSimulator::stop() {
+    while(!sessions.empty()) {
+        close(sessions.begin()->second);
+    }
+    if(timerButton) {
+        loop->cancelTimer(timerButton);
+        timerButton = 0;
+    }
+    if(listenfd >= 0) {
+        loop->removeHandler(listenfd);
+        ::close(listenfd);
+        listenfd = -1;
+        log_notice("simulated bridge stopped after %lu commands", commands);
+    }
+}
+
+uint64_t BridgeSimulator::random(uint64_t range) {
+    if(range == 0) return 0;
+    uint64_t value = ((uint64_t)rand_r(&seed) << 31) | (uint64_t)rand_r(&seed);
+    return value % range;
+}
+
+void BridgeSimulator::queue(session *s, const char *data, size_t len) {
+    // a later reply never overtakes an earlier one, whatever its jitter
+    uint64_t now = EventLoop::now();
+    uint64_t due = now + opts.latency + random(opts.jitter);
+    if(due < s->lastDue) due = s->lastDue;
+
+    if(!opts.partial) {
+        if(s->pending.empty() && due <= now) {
+            s->tx.append(data, len);
+            flush(s);
+            update(s);
+            return;
+        }
+        s->pending.push_back({due, std::string(data, len)});
+    }
+    else {
+        // a few bytes at a time with short pauses, so reads end mid-line and mid-prompt
+        for(size_t pos = 0; pos < len;) {
+            size_t n = 1 + random(8);
+            if(n > len - pos) n = len - pos;
+            s->pending.push_back({due, std::string(data + pos, n)});
+            pos += n;
+            due += 200000 + random(800000);
+        }
+    }
+    s->lastDue = due;
+    arm(s);
+}
+
+void BridgeSimulator::broadcast(const char *data, size_t len, const session *except) {
+    for(auto &it : sessions) {
+        if(it.second != except && it.second->state == sess_ready) {
+            queue(it.second, data, len);
+        }
+    }
+}
+
+void BridgeSimulator::arm(session *s) {
+    if(s->timerSend || s->pending.empty()) return;
+
+    uint64_t now = EventLoop::now();
+    uint64_t due = s->pending.front().due;
+    s->timerSend = loop->addTimer(due > now ? due - now : 0, onSend, s);
+}
+
+void BridgeSimulator::onSend(void *context) {
+    auto s = (session *) context;
+    auto sim = s->sim;
+    s->timerSend = 0;
+
+    // partial mode writes each chunk on its own
+    uint64_t now = EventLoop::now();
+    while(!s->pending.empty() && s->pending.front().due <= now) {
+        s->tx.append(s->pending.front().data);
+        s->pending.pop_front();
+        if(sim->opts.partial) break;
+    }
+    sim->flush(s);
+    sim->update(s);
+    sim->arm(s);
+}
+
+bool BridgeSimulator::flush(session *s) {
+    while(s->txOffset < s->tx.size()) {
+        auto rs = send(s->fd, s->tx.data() + s->txOffset, s->tx.size() - s->txOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(rs < 0) {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+
+            // the session is closed once epoll reports the error
+            s->tx.clear();
+            s->txOffset = 0;
+            return false;
+        }
+        s->txOffset += rs;
+    }
+
+    if(s->txOffset == s->tx.size()) {
+        s->tx.clear();
+        s->txOffset = 0;
+    }
+    return true;
+}
+
+void BridgeSimulator::update(session *s) {
+    uint32_t events = EPOLLIN;
+    if(s->txOffset < s->tx.size()) {
+        events |= EPOLLOUT;
+    }
+    if(events != s->events) {
+        s->events = events;
+        loop->modifyHandler(s->fd, events);
+    }
+}
+
+void BridgeSimulator::close(session *s) {
+    if(s->timerSend) loop->cancelTimer(s->timerSend);
+    if(s->timerDrop) loop->cancelTimer(s->timerDrop);
+    loop->removeHandler(s->fd);
+    ::close(s->fd);
+    sessions.erase(s->fd);
+    log_notice("simulated bridge session %d closed", s->fd);
+    delete s;
+}
+
+void BridgeSimulator::onAccept(void *context, uint32_t events) {
+    auto sim = (BridgeSimulator *) context;
+
+    for(;;) {
+        int fd = accept4(sim->listenfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_error_limited("simulated bridge accept() failed: %s", strerror(errno));
+            }
+            return;
+        }
+
+        // output is paced by the simulator itself, so do not let nagle merge it
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        auto s = new session();
+        s->sim = sim;
+        s->fd = fd;
+        s->state = sess_login;
+        s->userValid = false;
+        s->telnetState = 0;
+        s->lastDue = 0;
+        s->txOffset = 0;
+        s->events = EPOLLIN;
+        s->timerSend = 0;
+        s->timerDrop = 0;
+        if(!sim->loop->addHandler(fd, EPOLLIN, onSession, s)) {
+            ::close(fd);
+            delete s;
+            continue;
+        }
+        sim->sessions[fd] = s;
+        log_notice("simulated bridge session %d opened", fd);
+
+        if(sim->opts.disconnectMean > 0) {
+            // exponentially distributed session lifetime
+            double u = (sim->random(1000000) + 1) / 1000000.0;
+            auto lifetime = (uint64_t)(-std::log(u) * sim->opts.disconnectMean);
+            s->timerDrop = sim->loop->addTimer(lifetime, onDrop, s);
+        }
+
+        sim->queue(s, promptLogin, sizeof(promptLogin)-1);
+    }
+}
+
+void BridgeSimulator::onDrop(void *context) {
+    auto s = (session *) context;
+    s->timerDrop = 0;
+    log_notice("simulated bridge dropping session %d", s->fd);
+    s->sim->close(s);
+}
+
+size_t BridgeSimulator::filterTelnet(session *s, char *data, size_t len) {
+    // strips telnet commands and option negotiation, keeping escaped 0xff bytes
+    size_t out = 0;
+    for(size_t i = 0; i < len; i++) {
+        auto c = (uint8_t) data[i];
+        switch(s->telnetState) {
+            case 0:
+                if(c == telnetIAC) s->telnetState = 1;
+                else data[out++] = data[i];
+                break;
+            case 1:
+                if(c == telnetIAC) {
+                    data[out++] = data[i];
+                    s->telnetState = 0;
+                }
+                else if(c >= telnetWILL) s->telnetState = 2;
+                else if(c == telnetSB) s->telnetState = 3;
+                else s->telnetState = 0;
+                break;
+            case 2:
+                s->telnetState = 0;
+                break;
+            case 3:
+                if(c == telnetIAC) s->telnetState = 4;
+                break;
+            default:
+                s->telnetState = c == telnetSE ? 0 : 3;
+                break;
+        }
+    }
+    return out;
+}
+
+void BridgeSimulator::onSession(void *context, uint32_t events) {
+    auto s = (session *) context;
+    auto sim = s->sim;
+
+    if(events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        char buffer[4096];
+        for(;;) {
+            auto rs = recv(s->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if(rs > 0) {
+                size_t len = sim->filterTelnet(s, buffer, (size_t)rs);
+                if(!s->framer.write(buffer, len)) {
+                    log_error_limited("simulated bridge session %d sent an oversized line", s->fd);
+                }
+                continue;
+            }
+            if(rs < 0 && errno == EINTR) continue;
+            if(rs == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                sim->close(s);
+                return;
+            }
+            break;
+        }
+
+        LineFramer::slice line = {};
+        while(s->framer.next(line)) {
+            sim->process(s, line);
+        }
+    }
+
+    sim->flush(s);
+    sim->update(s);
+}
+
+void BridgeSimulator::process(session *s, LineFramer::slice line) {
+    static thread_local std::string reply;
+
+    switch(s->state) {
+        case sess_login:
+            // like the bridge, a bad user name is only reported after the password
+            s->userValid = line.equals(opts.username.c_str(), opts.username.size());
+            s->state = sess_password;
+            queue(s, promptPassword, sizeof(promptPassword)-1);
+            return;
+
+        case sess_password:
+            if(s->userValid && line.equals(opts.password.c_str(), opts.password.size())) {
+                s->state = sess_ready;
+                log_notice("simulated bridge session %d logged in", s->fd);
+                reply = "\r\n";
+                reply += promptCommand;
+            }
+            else {
+                log_notice("simulated bridge session %d rejected", s->fd);
+                s->state = sess_login;
+                reply = promptLogin;
+            }
+            queue(s, reply.data(), reply.size());
+            return;
+
+        case sess_ready:
+            break;
+    }
+
+    commands++;
+    log_debug("simulated bridge session %d recv %.*s", s->fd, (int)line.size, line.data);
+
+    // level changes are reported to every other session as well
+    reply.clear();
+    if(command(std::string(line.data, line.size), reply)) {
+        broadcast(reply.data(), reply.size(), s);
+    }
+    reply += promptCommand;
+    queue(s, reply.data(), reply.size());
+}
+
+bool BridgeSimulator::command(const std::string &line, std::string &reply) {
+    char temp[64];
+    const char *text = line.c_str();
+    bool query = strncmp(text, "?OUTPUT,", 8) == 0;
+    bool set = strncmp(text, "#OUTPUT,", 8) == 0;
+
+    if(!query && !set) {
+        snprintf(temp, sizeof(temp), "~ERROR,%d\r\n", errUnsupported);
+        reply = temp;
+        return false;
+    }
+
+    // ?OUTPUT,<id>[,1] or #OUTPUT,<id>,1,<level>[,<fade>[,<delay>]], fades complete instantly
+    char *end;
+    long id = strtol(text + 8, &end, 10);
+    auto it = zones.find((int)id);
+    int error = 0;
+    if(end == text + 8 || (set && *end != ',')) {
+        error = errParameterCount;
+    }
+    else if(it == zones.end()) {
+        error = errNoObject;
+    }
+    else if(*end == ',' && strtol(end + 1, &end, 10) != 1) {
+        error = errInvalidAction;
+    }
+    else if(set) {
+        const char *start = *end == ',' ? end + 1 : end;
+        double level = strtod(start, &end);
+        if(end == start) {
+            error = errParameterCount;
+        }
+        else if(level < 0 || level > 100) {
+            error = errOutOfRange;
+        }
+        else if(it->second.dimmer) {
+            it->second.level = (int32_t)lround(level * 100);
+        }
+        else {
+            it->second.level = level > 0 ? 10000 : 0;
+        }
+    }
+
+    if(error) {
+        snprintf(temp, sizeof(temp), "~ERROR,%d\r\n", error);
+        reply = temp;
+        return false;
+    }
+
+    int32_t level = it->second.level;
+    snprintf(temp, sizeof(temp), "~OUTPUT,%d,1,%d.%02d\r\n", (int)id, level / 100, level % 100);
+    reply = temp;
+    return set;
+}
+
+void BridgeSimulator::onButton(void *context) {
+    auto sim = (BridgeSimulator *) context;
+    char temp[64];
+    uint64_t delay;
+
+    if(sim->buttonDevice < 0) {
+        // press one of on, favorite, off, raise or lower on a random keypad
+        sim->buttonDevice = sim->keypads[sim->random(sim->keypads.size())];
+        sim->buttonNumber = 2 + (int)sim->random(5);
+        snprintf(temp, sizeof(temp), "~DEVICE,%d,%d,3\r\n", sim->buttonDevice, sim->buttonNumber);
+        delay = 100000000 + sim->random(200000000);
+    }
+    else {
+        snprintf(temp, sizeof(temp), "~DEVICE,%d,%d,4\r\n", sim->buttonDevice, sim->buttonNumber);
+        sim->buttonDevice = -1;
+        delay = sim->opts.buttonInterval / 2 + sim->random(sim->opts.buttonInterval);
+    }
+
+    sim->broadcast(temp, strlen(temp), nullptr);
+    sim->timerButton = sim->loop->addTimer(delay, onButton, sim);
+}
@@ -0,0 +1,110 @@
+#ifndef LUTRON_INTEGRATION_BRIDGE_SIMULATOR_H
+#define LUTRON_INTEGRATION_BRIDGE_SIMULATOR_H
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include "event_loop.h"
+#include "line_framer.h"
+
+/**
+ * Stand-in for a Caseta smart bridge on the telnet integration port. Sessions
+ * go through the `login:` / `password:` / `GNET> ` dialogue, zone levels are
+ * kept per integration id and answered for `?OUTPUT` and `#OUTPUT`, level
+ * changes are echoed to every session, and keypads can be made to emit
+ * `~DEVICE` button events on their own.
+ *
+ * Output is delayed by a fixed latency plus random jitter while keeping each
+ * session's byte order, may be cut into small chunks so the client sees
+ * partial reads, and sessions can be dropped at random to exercise reconnects.
+ */
+class BridgeSimulator {
+public:
+    struct options {
+        int port;
+        std::string username;
+        std::string password;
+        uint64_t latency;           // ns before each reply
+        uint64_t jitter;            // up to this many ns added to the latency
+        bool partial;               // write replies a few bytes at a time
+        uint64_t disconnectMean;    // mean ns a session lives before it is dropped, 0 never
+        uint64_t buttonInterval;    // ns between keypad button events, 0 disables them
+        unsigned int seed;
+    };
+
+private:
+    enum session_state {
+        sess_login,
+        sess_password,
+        sess_ready
+    };
+
+    struct chunk {
+        uint64_t due;
+        std::string data;
+    };
+
+    struct session {
+        BridgeSimulator *sim;
+        int fd;
+        session_state state;
+        bool userValid;
+        LineFramer framer;
+        int telnetState;            // position inside a telnet command sequence
+        std::deque<chunk> pending;  // output waiting for its due time, in order
+        uint64_t lastDue;
+        std::string tx;
+        size_t txOffset;
+        uint32_t events;
+        uint64_t timerSend, timerDrop;
+    };
+
+    struct zone {
+        int32_t level;              // hundredths of a percent
+        bool dimmer;
+    };
+
+    options opts;
+    EventLoop *loop;
+    int listenfd;
+    unsigned int seed;
+    uint64_t timerButton;
+    int buttonDevice, buttonNumber;     // button currently held down, if any
+    uint64_t commands;
+
+    std::map<int, zone> zones;
+    std::vector<int> keypads;
+    std::map<int, session *> sessions;
+
+    uint64_t random(uint64_t range);
+    void queue(session *s, const char *data, size_t len);
+    void broadcast(const char *data, size_t len, const session *except);
+    void arm(session *s);
+    bool flush(session *s);
+    void update(session *s);
+    void close(session *s);
+    size_t filterTelnet(session *s, char *data, size_t len);
+    void process(session *s, LineFramer::slice line);
+    bool command(const std::string &line, std::string &reply);
+
+    static void onAccept(void *context, uint32_t events);
+    static void onSession(void *context, uint32_t events);
+    static void onSend(void *context);
+    static void onDrop(void *context);
+    static void onButton(void *context);
+
+public:
+    BridgeSimulator(EventLoop *loop, const options &opts);
+    ~BridgeSimulator();
+
+    void addZone(int id, bool dimmer);
+    void addKeypad(int id);
+
+    bool start();
+    void stop();
+};
+
+
+#endif //LUTRON_INTEGRATION_BRIDGE_SIMULATOR_H
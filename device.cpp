@@ -7,6 +7,7 @@
 #include "device.h"
 #include "room.h"
 #include "lutron_connector.h"
+#include "state_store.h"
 #include "logging.h"
 
 static const char *str_dtype[7] = {
@@ -29,20 +30,31 @@ static const char *str_button[] = {
         "down"
 };
 
+static void commandComplete(const LutronConnector::command_result &result, void *context) {
+    auto dev = (const device *) context;
+    if(result.coalesced) {
+        log_debug("`%s` command `%s` replaced before it was sent", dev->name.c_str(), result.command.c_str());
+    }
+    else if(result.success) {
+        log_debug("`%s` command `%s` completed in %0.3f ms", dev->name.c_str(), result.command.c_str(),
+                  (result.completed - result.queued) / 1e6);
+    }
+    else {
+        log_error(dev->logFields("command_failed"), "`%s` command `%s` failed: %s",
+                  dev->name.c_str(), result.command.c_str(),
+                  result.response.empty() ? "connection lost" : result.response.c_str());
+    }
+}
+
 device::device(int i, const char *n, const char *d, device_type t, room *l) :
 id(i), name(n), description(d), type(t), location(l)
 {
     conn = nullptr;
-    if(location) {
-        location->devices.insert(this);
-    }
+    states = nullptr;
+    slot = 0;
 }
 
-device::~device() {
-    if(location) {
-        location->devices.erase(this);
-    }
-}
+device::~device() = default;
 
 device* device::parse(json_object *object, std::map<std::string, room *> &rooms) {
     json_object *jtmp;
@@ -128,21 +140,23 @@ void device::requestRefresh() const {
     // do nothing by default
 }
 
-void device::processMessage(const char *command, const char **fields, int fcnt) {
+void device::processMessage(const lutron_message &msg) {
     // process button events
-    if(fcnt < 2) return;
-    if(strcmp(command, "DEVICE") == 0) {
-        auto button = (button_t) atoi(fields[0]);
-        int event = atoi(fields[1]);
+    if(msg.command == lutron_message::cmd_device && msg.argc >= 1) {
+        auto button = (button_t) msg.action;
+        int event = msg.args[0] / lutron_message::fixed_one;
+        if(button < 0 || button >= (int)(sizeof(str_button)/sizeof(const char *))) {
+            button = unknown;
+        }
 
         if(event == 3) {
-            log_notice("event `%s` button `%s` pressed", name.c_str(), str_button[button]);
+            log_notice(logFields("button_pressed"), "event `%s` button `%s` pressed", name.c_str(), str_button[button]);
             for(auto l : listeners) {
                 l->buttonEvent(this, button, true);
             }
         }
         else if(event == 4) {
-            log_notice("event `%s` button `%s` released", name.c_str(), str_button[button]);
+            log_notice(logFields("button_released"), "event `%s` button `%s` released", name.c_str(), str_button[button]);
             for(auto l : listeners) {
                 l->buttonEvent(this, button, false);
             }
@@ -154,6 +168,14 @@ void device::setOff() {}
 
 void device::setOn() {}
 
+bool device::applyLevel(int32_t level, int fade, LutronConnector::batch_command &cmd) {
+    return false;
+}
+
+log_fields device::logFields(const char *event, int32_t level) const {
+    return { id, location ? location->name.c_str() : nullptr, level, event };
+}
+
 void device::addListener(listener *l) {
     listeners.insert(l);
 }
@@ -167,23 +189,22 @@ void device::removeListener(listener *l) {
 device_dimmer::device_dimmer(int id, const char *name, const char *desc, device_type type, room *loc) :
 device(id, name, desc, type, loc)
 {
-    level = 0;
+
 }
 
 void device_dimmer::requestRefresh() const {
     char temp[32];
     sprintf(temp, "?OUTPUT,%d,1", id);
-    conn->sendCommand(temp);
+    conn->submitCommand(temp, commandComplete, (void *) this, LutronConnector::prio_refresh);
 }
 
-void device_dimmer::processMessage(const char *command, const char **fields, int fcnt) {
-    device::processMessage(command, fields, fcnt);
+void device_dimmer::processMessage(const lutron_message &msg) {
+    device::processMessage(msg);
 
-    if(strcmp(command, "OUTPUT") == 0) {
-        if(strcmp(fields[0], "1") == 0) {
-            sscanf(fields[1], "%f", &level);
-            log_notice("update `%s` set `level` = %0.02f", name.c_str(), level);
-        }
+    if(msg.command == lutron_message::cmd_output && msg.action == 1 && msg.argc >= 1) {
+        states->setLevel(slot, msg.args[0]);
+        log_notice(logFields("update", msg.args[0]), "update `%s` set `level` = %0.02f",
+                   name.c_str(), (float)msg.args[0] / lutron_message::fixed_one);
     }
 }
 
@@ -196,50 +217,65 @@ void device_dimmer::setOff() {
 }
 
 float device_dimmer::getLevel() const {
-    return level;
+    return (float)states->getLevel(slot) / lutron_message::fixed_one;
 }
 
 void device_dimmer::setLevel(float l, int fade) {
     if(std::isnan(l)) l = 0;
-    if(l < 0) l = 0;
-    if(l > 100.0) l = 100.0;
 
-    level = l;
-    log_notice("update `%s` set `level` = %0.02f", name.c_str(), level);
+    LutronConnector::batch_command cmd;
+    applyLevel((int32_t)lroundf(l * lutron_message::fixed_one), fade, cmd);
+    conn->submitCommand(cmd.command.c_str(), cmd.completion, cmd.context);
+}
+
+bool device_dimmer::applyLevel(int32_t level, int fade, LutronConnector::batch_command &cmd) {
+    if(level < 0) level = 0;
+    if(level > 100 * lutron_message::fixed_one) level = 100 * lutron_message::fixed_one;
+
+    int whole = level / lutron_message::fixed_one;
+    int part = level % lutron_message::fixed_one;
+    log_notice(logFields("set", level), "request `%s` set `level` = %d.%02d", name.c_str(), whole, part);
 
     if(fade < 0) fade = 0;
     if(fade > 3599) fade = 3599;
     int m = fade / 60;
     int s = fade % 60;
-    char cmd[32];
-    sprintf(cmd, "#OUTPUT,%d,1,%0.2f,%02d:%02d", id, level, m, s);
+    char temp[48];
+    sprintf(temp, "#OUTPUT,%d,1,%d.%02d,%02d:%02d", id, whole, part, m, s);
+    cmd.command = temp;
+    cmd.completion = commandComplete;
+    cmd.context = (void *) this;
+    return true;
 }
 
 
 
 
+// a switch reads as on from half brightness up, for reports and requests alike
+static bool isOnLevel(int32_t level) {
+    return level >= 50 * lutron_message::fixed_one;
+}
+
 device_switch::device_switch(int id, const char *name, const char *desc, device_type type, room *loc) :
 device(id, name, desc, type, loc)
 {
-    state = false;
+
 }
 
 void device_switch::requestRefresh() const {
     char temp[32];
     sprintf(temp, "?OUTPUT,%d,1", id);
-    conn->sendCommand(temp);
+    conn->submitCommand(temp, commandComplete, (void *) this, LutronConnector::prio_refresh);
 }
 
-void device_switch::processMessage(const char *command, const char **fields, int fcnt) {
-    device::processMessage(command, fields, fcnt);
+void device_switch::processMessage(const lutron_message &msg) {
+    device::processMessage(msg);
 
-    if(strcmp(command, "OUTPUT") == 0) {
-        if(strcmp(fields[0], "1") == 0) {
-            float temp;
-            sscanf(fields[1], "%f", &temp);
-            state = temp >= 50;
-            log_notice("update `%s` set `state` = %s", name.c_str(), state?"on":"off");
-        }
+    if(msg.command == lutron_message::cmd_output && msg.action == 1 && msg.argc >= 1) {
+        bool state = isOnLevel(msg.args[0]);
+        states->setOn(slot, state);
+        log_notice(logFields("update", state ? 100 * lutron_message::fixed_one : 0),
+                   "update `%s` set `state` = %s", name.c_str(), state?"on":"off");
     }
 }
 
@@ -252,20 +288,30 @@ void device_switch::setOff() {
 }
 
 bool device_switch::getState() const {
-    return state;
+    return states->getOn(slot);
+}
+
+void device_switch::setState(bool state) {
+    LutronConnector::batch_command cmd;
+    applyLevel(state ? 100 * lutron_message::fixed_one : 0, 0, cmd);
+    conn->submitCommand(cmd.command.c_str(), cmd.completion, cmd.context);
 }
 
-void device_switch::setState(bool s) {
-    state = s;
-    log_notice("update `%s` set `state` = %s", name.c_str(), state?"on":"off");
+bool device_switch::applyLevel(int32_t level, int fade, LutronConnector::batch_command &cmd) {
+    bool state = isOnLevel(level);
+    log_notice(logFields("set", state ? 100 * lutron_message::fixed_one : 0),
+               "request `%s` set `state` = %s", name.c_str(), state?"on":"off");
 
-    char cmd[32];
+    // switches ignore the fade time
+    char temp[32];
     if(state)
-        sprintf(cmd, "#OUTPUT,%d,1,100", id);
+        sprintf(temp, "#OUTPUT,%d,1,100", id);
     else
-        sprintf(cmd, "#OUTPUT,%d,1,0", id);
-
-    conn->sendCommand(cmd);
+        sprintf(temp, "#OUTPUT,%d,1,0", id);
+    cmd.command = temp;
+    cmd.completion = commandComplete;
+    cmd.context = (void *) this;
+    return true;
 }
 
 
@@ -281,6 +327,6 @@ void device_remote::requestRefresh() const {
     // do nothing
 }
 
-void device_remote::processMessage(const char *command, const char **fields, int fcnt) {
-    device::processMessage(command, fields, fcnt);
+void device_remote::processMessage(const lutron_message &msg) {
+    device::processMessage(msg);
 }
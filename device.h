@@ -9,9 +9,12 @@
 #include <map>
 #include <json-c/json_object.h>
 #include <set>
+#include "lutron_message.h"
+#include "lutron_connector.h"
 
-class LutronConnector;
 class room;
+class state_store;
+struct log_fields;
 
 class device {
 public:
@@ -41,6 +44,8 @@ public:
     };
 
     LutronConnector *conn;
+    state_store *states;
+    size_t slot;
 
     const int id;
     const std::string name;
@@ -54,50 +59,53 @@ public:
     static device * parse(json_object *object, std::map<std::string, room *> &rooms);
 
     virtual void requestRefresh() const;
-    virtual void processMessage(const char *command, const char **fields, int fcnt);
+    virtual void processMessage(const lutron_message &msg);
 
     virtual void setOn();
     virtual void setOff();
 
+    // prepares the bridge command for a new level (hundredths of a percent), false if the
+    // device has no output; the state store follows the bridge's ~OUTPUT report, not the request
+    virtual bool applyLevel(int32_t level, int fade, LutronConnector::batch_command &cmd);
+
     void addListener(listener *l);
     void removeListener(listener *l);
 
+    // journal fields identifying this device, `level` in hundredths of a percent or negative
+    log_fields logFields(const char *event, int32_t level = -1) const;
+
 private:
     std::set<listener *> listeners;
 
 };
 
 class device_dimmer : public device {
-private:
-    float level;
-
 public:
     device_dimmer(int id, const char *name, const char *desc, device_type type, room *loc);
     ~device_dimmer() override = default;
 
     void requestRefresh() const override;
-    void processMessage(const char *command, const char **fields, int fcnt) override;
+    void processMessage(const lutron_message &msg) override;
 
     void setOn() override;
     void setOff() override;
+    bool applyLevel(int32_t level, int fade, LutronConnector::batch_command &cmd) override;
 
     float getLevel() const;
     void setLevel(float level, int fade);
 };
 
 class device_switch : public device {
-private:
-    bool state;
-
 public:
     device_switch(int id, const char *name, const char *desc, device_type type, room *loc);
     ~device_switch() override = default;
 
     void requestRefresh() const override;
-    void processMessage(const char *command, const char **fields, int fcnt) override;
+    void processMessage(const lutron_message &msg) override;
 
     void setOn() override;
     void setOff() override;
+    bool applyLevel(int32_t level, int fade, LutronConnector::batch_command &cmd) override;
 
     bool getState() const;
     void setState(bool state);
@@ -109,7 +117,7 @@ public:
     ~device_remote() override = default;
 
     void requestRefresh() const override;
-    void processMessage(const char *command, const char **fields, int fcnt) override;
+    void processMessage(const lutron_message &msg) override;
 };
 
 #endif //LUTRON_INTEGRATION_DEVICE_H
@@ -0,0 +1,128 @@
+#include <algorithm>
+#include <cstring>
+#include "device_table.h"
+#include "room.h"
+#include "logging.h"
+
+device_table::device_table() {
+    nameSeed = 0;
+    nameMask = 0;
+}
+
+uint32_t device_table::hash(uint32_t seed, const char *name, size_t len) {
+    // FNV-1a with a seeded offset basis
+    uint32_t h = 2166136261u ^ seed;
+    for(size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+bool device_table::add(device *dev) {
+    if(dev->id < 0 || dev->id > max_id) {
+        log_error("device entry `id` is out of range: %d", dev->id);
+        return false;
+    }
+    if(find(dev->id) != nullptr) {
+        log_error("device entry is already defined: %d", dev->id);
+        return false;
+    }
+    for(auto d : list) {
+        if(d->name == dev->name) {
+            log_error("device entry is already defined: %s", dev->name.c_str());
+            return false;
+        }
+    }
+
+    if((size_t)dev->id >= byId.size()) {
+        byId.resize((size_t)dev->id + 1, nullptr);
+    }
+    byId[dev->id] = dev;
+    list.push_back(dev);
+    return true;
+}
+
+void device_table::finalize() {
+    std::sort(list.begin(), list.end(), [](const device *a, const device *b) { return a->id < b->id; });
+    for(size_t i = 0; i < list.size(); i++) {
+        list[i]->slot = i;
+    }
+    buildRooms();
+
+    // search for a seed that maps every name to its own slot
+    size_t size = 1;
+    while(size < list.size() * 2) size <<= 1;
+    for(;;) {
+        for(uint32_t seed = 1; seed < 4096; seed++) {
+            byName.assign(size, {nullptr, nullptr});
+            bool collision = false;
+            for(auto d : list) {
+                auto &slot = byName[hash(seed, d->name.data(), d->name.size()) & (size - 1)];
+                if(slot.dev) {
+                    collision = true;
+                    break;
+                }
+                slot = {&d->name, d};
+            }
+            if(!collision) {
+                nameSeed = seed;
+                nameMask = (uint32_t)(size - 1);
+                return;
+            }
+        }
+        size <<= 1;
+    }
+}
+
+device * device_table::find(const char *name, size_t len) const {
+    if(byName.empty()) return nullptr;
+
+    auto &slot = byName[hash(nameSeed, name, len) & nameMask];
+    if(slot.dev && slot.name->size() == len && memcmp(slot.name->data(), name, len) == 0) {
+        return slot.dev;
+    }
+    return nullptr;
+}
+
+void device_table::buildRooms() {
+    roomList.clear();
+    for(auto d : list) {
+        if(d->location && std::find(roomList.begin(), roomList.end(), d->location) == roomList.end()) {
+            d->location->slot = roomList.size();
+            roomList.push_back(d->location);
+        }
+    }
+
+    // counting sort by room keeps id order within each room
+    roomOffsets.assign(roomList.size() + 1, 0);
+    for(auto d : list) {
+        if(d->location) roomOffsets[d->location->slot + 1]++;
+    }
+    for(size_t i = 1; i < roomOffsets.size(); i++) {
+        roomOffsets[i] += roomOffsets[i - 1];
+    }
+
+    byRoom.assign(roomOffsets.back(), nullptr);
+    std::vector<size_t> fill(roomOffsets.begin(), roomOffsets.end() - 1);
+    for(auto d : list) {
+        if(d->location) byRoom[fill[d->location->slot]++] = d;
+    }
+}
+
+room * device_table::findRoom(const char *name, size_t len) const {
+    for(auto r : roomList) {
+        if(r->name.size() == len && memcmp(r->name.data(), name, len) == 0) {
+            return r;
+        }
+    }
+    return nullptr;
+}
+
+device_table::device_range device_table::inRoom(const room *loc) const {
+    if(loc == nullptr || loc->slot >= roomList.size() || roomList[loc->slot] != loc) {
+        return {nullptr, nullptr};
+    }
+    auto base = byRoom.data();
+    return {base + roomOffsets[loc->slot], base + roomOffsets[loc->slot + 1]};
+}
@@ -0,0 +1,71 @@
+#ifndef LUTRON_INTEGRATION_DEVICE_TABLE_H
+#define LUTRON_INTEGRATION_DEVICE_TABLE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "device.h"
+
+/**
+ * Device registry indexed by integration id and by name.
+ * Ids index a flat table directly; names go through a perfect hash that
+ * finalize() builds once the configuration has been loaded. finalize() also
+ * assigns each device its state store slot, in id order, and groups devices
+ * by room into one contiguous array so a room is a slice of it.
+ */
+class device_table {
+public:
+    static const int max_id = 4096;
+
+    struct device_range {
+        device * const *first;
+        device * const *last;
+
+        device * const *begin() const { return first; }
+        device * const *end() const { return last; }
+        size_t size() const { return (size_t)(last - first); }
+    };
+
+private:
+    struct name_slot {
+        const std::string *name;
+        device *dev;
+    };
+
+    std::vector<device *> list;
+    std::vector<device *> byId;
+    std::vector<name_slot> byName;
+    uint32_t nameSeed;
+    uint32_t nameMask;
+
+    std::vector<room *> roomList;       // indexed by room slot
+    std::vector<size_t> roomOffsets;    // room slot -> first entry in byRoom
+    std::vector<device *> byRoom;
+
+    static uint32_t hash(uint32_t seed, const char *name, size_t len);
+    void buildRooms();
+
+public:
+    device_table();
+    ~device_table() = default;
+
+    bool add(device *dev);
+    void finalize();
+
+    device * find(int id) const {
+        return (unsigned)id < byId.size() ? byId[id] : nullptr;
+    }
+    device * find(const char *name, size_t len) const;
+    device * find(const std::string &name) const { return find(name.data(), name.size()); }
+
+    // rooms that have at least one device; lookups are a short scan
+    room * findRoom(const char *name, size_t len) const;
+    device_range inRoom(const room *loc) const;
+
+    size_t size() const { return list.size(); }
+    std::vector<device *>::const_iterator begin() const { return list.begin(); }
+    std::vector<device *>::const_iterator end() const { return list.end(); }
+};
+
+
+#endif //LUTRON_INTEGRATION_DEVICE_TABLE_H
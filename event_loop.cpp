@@ -0,0 +1,196 @@
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include "event_loop.h"
+#include "logging.h"
+
+EventLoop::EventLoop() :
+    mutexPost(PTHREAD_MUTEX_INITIALIZER)
+{
+    // set up front, a stop() that lands before run() is reached must not be lost
+    running = true;
+    owner = pthread_self();
+    timerNext = 1;
+    timerArmed = 0;
+
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(epollfd < 0 || wakefd < 0 || timerfd < 0) {
+        log_error("event loop setup failed: %s", strerror(errno));
+    }
+
+    addHandler(wakefd, EPOLLIN, onWake, this);
+    addHandler(timerfd, EPOLLIN, onTimer, this);
+}
+
+EventLoop::~EventLoop() {
+    for(auto &w : watches) {
+        delete w.second;
+    }
+    for(auto w : retired) {
+        delete w;
+    }
+    close(timerfd);
+    close(wakefd);
+    close(epollfd);
+}
+
+uint64_t EventLoop::now() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+bool EventLoop::addHandler(int fd, uint32_t events, handler_t handler, void *context) {
+    if(watches.find(fd) != watches.end()) {
+        log_error("event loop handler already registered for fd %d", fd);
+        return false;
+    }
+
+    auto w = new watch_t{fd, handler, context};
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.ptr = w;
+    if(epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        log_error("event loop failed to add fd %d: %s", fd, strerror(errno));
+        delete w;
+        return false;
+    }
+
+    watches[fd] = w;
+    return true;
+}
+
+bool EventLoop::modifyHandler(int fd, uint32_t events) {
+    auto it = watches.find(fd);
+    if(it == watches.end()) return false;
+
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.ptr = it->second;
+    return epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+void EventLoop::removeHandler(int fd) {
+    auto it = watches.find(fd);
+    if(it == watches.end()) return;
+
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, nullptr);
+
+    // events for this fd may still be pending in the current batch
+    it->second->handler = nullptr;
+    retired.push_back(it->second);
+    watches.erase(it);
+}
+
+uint64_t EventLoop::addTimer(uint64_t delayNanos, task_t task, void *context) {
+    uint64_t id = timerNext++;
+    timers.insert({now() + delayNanos, {id, {task, context}}});
+    armTimer();
+    return id;
+}
+
+void EventLoop::cancelTimer(uint64_t id) {
+    for(auto it = timers.begin(); it != timers.end(); it++) {
+        if(it->second.first == id) {
+            timers.erase(it);
+            armTimer();
+            return;
+        }
+    }
+}
+
+void EventLoop::armTimer() {
+    uint64_t deadline = timers.empty() ? 0 : timers.begin()->first;
+    if(deadline == timerArmed) return;
+    timerArmed = deadline;
+
+    // an all-zero value disarms the timer
+    struct itimerspec its = {};
+    its.it_value.tv_sec = (time_t)(deadline / 1000000000ull);
+    its.it_value.tv_nsec = (long)(deadline % 1000000000ull);
+    timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, nullptr);
+}
+
+void EventLoop::onTimer(void *context, uint32_t events) {
+    auto ctx = (EventLoop *) context;
+    uint64_t expirations;
+    while(read(ctx->timerfd, &expirations, sizeof(expirations)) > 0);
+
+    ctx->timerArmed = 0;
+    uint64_t t = now();
+    while(!ctx->timers.empty() && ctx->timers.begin()->first <= t) {
+        auto entry = ctx->timers.begin()->second.second;
+        ctx->timers.erase(ctx->timers.begin());
+        (*entry.task)(entry.context);
+    }
+    ctx->armTimer();
+}
+
+void EventLoop::post(task_t task, void *context) {
+    pthread_mutex_lock(&mutexPost);
+    posted.push_back({task, context});
+    pthread_mutex_unlock(&mutexPost);
+
+    uint64_t one = 1;
+    if(write(wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        log_error("event loop wakeup failed: %s", strerror(errno));
+    }
+}
+
+void EventLoop::onWake(void *context, uint32_t events) {
+    auto ctx = (EventLoop *) context;
+    uint64_t count;
+    while(read(ctx->wakefd, &count, sizeof(count)) > 0);
+
+    std::vector<task_entry> tasks;
+    pthread_mutex_lock(&ctx->mutexPost);
+    tasks.swap(ctx->posted);
+    pthread_mutex_unlock(&ctx->mutexPost);
+
+    for(auto &t : tasks) {
+        (*t.task)(t.context);
+    }
+}
+
+void EventLoop::stop() {
+    running = false;
+    uint64_t one = 1;
+    if(write(wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        log_error("event loop wakeup failed: %s", strerror(errno));
+    }
+}
+
+bool EventLoop::inLoopThread() const {
+    return pthread_equal(owner, pthread_self()) != 0;
+}
+
+void EventLoop::run() {
+    struct epoll_event events[64];
+
+    owner = pthread_self();
+    while(running) {
+        int n = epoll_wait(epollfd, events, 64, -1);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            log_error_limited("event loop epoll_wait() failed: %s", strerror(errno));
+            break;
+        }
+
+        for(int i = 0; i < n; i++) {
+            auto w = (watch_t *) events[i].data.ptr;
+            if(w->handler) {
+                (*w->handler)(w->context, events[i].events);
+            }
+        }
+
+        for(auto w : retired) {
+            delete w;
+        }
+        retired.clear();
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef LUTRON_INTEGRATION_EVENT_LOOP_H
+#define LUTRON_INTEGRATION_EVENT_LOOP_H
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <vector>
+#include <pthread.h>
+#include <sys/epoll.h>
+
+class EventLoop {
+public:
+    typedef void (*handler_t)(void *context, uint32_t events);
+    typedef void (*task_t)(void *context);
+
+private:
+    struct watch_t {
+        int fd;
+        handler_t handler;
+        void *context;
+    };
+
+    struct task_entry {
+        task_t task;
+        void *context;
+    };
+
+    int epollfd, wakefd, timerfd;
+    std::atomic<bool> running;     // cleared by stop() from any thread
+    pthread_t owner;
+
+    // file descriptor handlers
+    std::map<int, watch_t *> watches;
+    std::vector<watch_t *> retired;
+
+    // one-shot timers ordered by deadline
+    std::multimap<uint64_t, std::pair<uint64_t, task_entry>> timers;
+    uint64_t timerNext;
+    uint64_t timerArmed;
+
+    // cross-thread task queue
+    pthread_mutex_t mutexPost;
+    std::vector<task_entry> posted;
+
+    static void onWake(void *context, uint32_t events);
+    static void onTimer(void *context, uint32_t events);
+    void armTimer();
+
+public:
+    EventLoop();
+    ~EventLoop();
+
+    static uint64_t now();
+
+    bool addHandler(int fd, uint32_t events, handler_t handler, void *context);
+    bool modifyHandler(int fd, uint32_t events);
+    void removeHandler(int fd);
+
+    uint64_t addTimer(uint64_t delayNanos, task_t task, void *context);
+    void cancelTimer(uint64_t id);
+
+    // thread-safe
+    void post(task_t task, void *context);
+    void stop();
+    bool inLoopThread() const;
+
+    // runs until stop(), a loop is only run once
+    void run();
+};
+
+
+#endif //LUTRON_INTEGRATION_EVENT_LOOP_H
@@ -0,0 +1,99 @@
+#include <cstring>
+#include "line_framer.h"
+
+static inline bool isTerminator(char c) {
+    return c == '\r' || c == '\n';
+}
+
+bool LineFramer::slice::equals(const char *str, size_t len) const {
+    return size == len && memcmp(data, str, len) == 0;
+}
+
+bool LineFramer::slice::startsWith(const char *str, size_t len) const {
+    return size >= len && memcmp(data, str, len) == 0;
+}
+
+LineFramer::LineFramer(size_t capacity) {
+    // power of two so positions wrap with a mask
+    size_t cap = 64;
+    while(cap < capacity) cap <<= 1;
+
+    ring.resize(cap);
+    scratch.resize(cap);
+    mask = cap - 1;
+    head = tail = scan = 0;
+}
+
+bool LineFramer::write(const char *data, size_t len) {
+    bool accepted = true;
+    size_t cap = ring.size();
+
+    if(len > cap - (size_t)(tail - head)) {
+        // a line longer than the ring is not protocol data, drop what we have
+        head = scan = tail;
+        if(len > cap) {
+            data += len - cap;
+            len = cap;
+        }
+        accepted = false;
+    }
+
+    size_t off = (size_t)tail & mask;
+    size_t first = len < cap - off ? len : cap - off;
+    memcpy(&ring[off], data, first);
+    memcpy(&ring[0], data + first, len - first);
+    tail += len;
+    return accepted;
+}
+
+LineFramer::slice LineFramer::extract(uint64_t from, size_t len) {
+    size_t cap = ring.size();
+    size_t off = (size_t)from & mask;
+    if(off + len <= cap) {
+        return {&ring[off], len};
+    }
+
+    // only a line that wraps around the end of the ring is copied
+    size_t first = cap - off;
+    memcpy(&scratch[0], &ring[off], first);
+    memcpy(&scratch[first], &ring[0], len - first);
+    return {&scratch[0], len};
+}
+
+bool LineFramer::next(slice &line) {
+    while(head < tail && isTerminator(ring[(size_t)head & mask])) {
+        head++;
+    }
+    if(scan < head) {
+        scan = head;
+    }
+
+    // resume scanning where the previous call stopped
+    for(; scan < tail; scan++) {
+        if(isTerminator(ring[(size_t)scan & mask])) {
+            line = extract(head, (size_t)(scan - head));
+            head = ++scan;
+            return true;
+        }
+    }
+    return false;
+}
+
+LineFramer::slice LineFramer::pending() {
+    while(head < tail && isTerminator(ring[(size_t)head & mask])) {
+        head++;
+    }
+    return extract(head, (size_t)(tail - head));
+}
+
+void LineFramer::consume(size_t len) {
+    size_t avail = (size_t)(tail - head);
+    head += len < avail ? len : avail;
+    if(scan < head) {
+        scan = head;
+    }
+}
+
+void LineFramer::clear() {
+    head = tail = scan = 0;
+}
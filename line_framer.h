@@ -0,0 +1,47 @@
+#ifndef LUTRON_INTEGRATION_LINE_FRAMER_H
+#define LUTRON_INTEGRATION_LINE_FRAMER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Splits a byte stream into CR/LF terminated lines across arbitrary read boundaries.
+ * Lines are handed out as slices into the ring buffer and are only copied when they
+ * wrap around its end. A slice stays valid until the next call to write().
+ */
+class LineFramer {
+public:
+    struct slice {
+        const char *data;
+        size_t size;
+
+        bool equals(const char *str, size_t len) const;
+        bool startsWith(const char *str, size_t len) const;
+    };
+
+private:
+    std::vector<char> ring, scratch;
+    size_t mask;
+    uint64_t head, tail, scan;
+
+    slice extract(uint64_t from, size_t len);
+
+public:
+    explicit LineFramer(size_t capacity = 4096);
+
+    // returns false if the buffered partial line overflowed and was discarded
+    bool write(const char *data, size_t len);
+
+    // next complete line without its terminator, empty lines are skipped
+    bool next(slice &line);
+
+    // unterminated data at the end of the stream, e.g. a prompt
+    slice pending();
+    void consume(size_t len);
+
+    void clear();
+};
+
+
+#endif //LUTRON_INTEGRATION_LINE_FRAMER_H
@@ -2,57 +2,488 @@
 // Created by robert on 5/12/18.
 //
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
 #include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include "logging.h"
 
-static bool enabled_error = true;
-static bool enabled_notice = true;
-static bool enabled_debug = false;
+std::atomic<int> log_level(LOG_LEVEL_NOTICE);
 
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static const char *level_names[] = { "error", "notice", "debug" };
 
-void log_error(const char* format, ...)
-{
-    if(enabled_error) {
-        va_list argptr;
-        va_start(argptr, format);
+// syslog priorities for each level, as journald expects them
+static const int level_priorities[] = { 3, 5, 7 };
 
-        pthread_mutex_lock(&mutex);
-        vfprintf(stdout, format, argptr);
-        fwrite("\n", 1, 1, stdout);
-        fflush(stdout);
-        pthread_mutex_unlock(&mutex);
+/*
+ * Every thread that logs owns a single producer, single consumer ring of fixed
+ * size records. Messages are formatted straight into the ring without taking a
+ * lock and a background thread writes them out in batches, so a thread that
+ * logs never waits on stdout or the journal. When a ring is full the message
+ * is dropped and counted instead of blocking the producer.
+ *
+ * When stdout is connected to the journal, records are sent as native journal
+ * entries instead, so the structured fields survive and can be matched on.
+ */
+namespace {
+
+const size_t record_size = 256;
+const size_t ring_records = 256;    // must be a power of two
+const size_t batch_entries = 64;
+const uint32_t limit_burst = 5;                 // messages per call site and window
+const uint64_t limit_window = 10000000000;      // ns
+
+struct log_record {
+    uint16_t len;       // message plus journal fields
+    uint16_t message;   // length of the message alone
+    uint8_t level;
+    char text[record_size - 5];
+};
 
-        va_end(argptr);
+struct log_ring {
+    std::atomic<uint32_t> head;     // advanced by the owning thread
+    char pad[60];                   // keeps the two indexes on separate cache lines
+    std::atomic<uint32_t> tail;     // advanced by the drainer
+    std::atomic<uint32_t> dropped;
+    log_record records[ring_records];
+};
+
+// one formatted entry in the drainer's batch buffer
+struct batch_entry {
+    size_t offset, size;
+    size_t message, messageLen;     // message text, for the stdout fallback
+};
+
+pthread_once_t once = PTHREAD_ONCE_INIT;
+pthread_mutex_t mutexDrain = PTHREAD_MUTEX_INITIALIZER;    // guards the ring list and drainer sleep
+pthread_cond_t condDrain = PTHREAD_COND_INITIALIZER;
+pthread_t drainer;
+std::vector<log_ring *> rings;
+std::vector<log_limit *> limits;   // call sites that suppressed messages, guarded by mutexDrain
+std::atomic<bool> running(false), stopping(false), drainerIdle(false);
+
+// drainer state
+int journalfd = -1;
+sockaddr_un journalAddress;
+char batch[65536];
+size_t batchUsed;
+batch_entry entries[batch_entries];
+size_t entryCount;
+
+thread_local log_ring *ring = nullptr;
+
+void write_all(const char *data, size_t len) {
+    while(len > 0) {
+        auto rs = ::write(STDOUT_FILENO, data, len);
+        if(rs < 0) {
+            if(errno == EINTR) continue;
+            return;
+        }
+        data += rs;
+        len -= rs;
     }
 }
 
-void log_notice(const char* format, ...)
-{
-    if(enabled_notice) {
-        va_list argptr;
-        va_start(argptr, format);
-        pthread_mutex_lock(&mutex);
-        vfprintf(stdout, format, argptr);
-        fwrite("\n", 1, 1, stdout);
-        fflush(stdout);
-        pthread_mutex_unlock(&mutex);
-        va_end(argptr);
+uint64_t now() {
+    timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// starts a new window once the current one is over; returns how many messages it suppressed
+uint32_t limit_roll(log_limit &limit, uint64_t time) {
+    uint64_t window = limit.window.load(std::memory_order_relaxed);
+    if(time - window < limit_window || !limit.window.compare_exchange_strong(window, time)) {
+        return 0;
     }
+    uint32_t count = limit.count.exchange(0);
+    return count > limit_burst ? count - limit_burst : 0;
 }
 
-void log_debug(const char* format, ...)
-{
-    if(enabled_debug) {
-        va_list argptr;
-        va_start(argptr, format);
+int limit_summary(const log_limit &limit, uint32_t suppressed, char *out, size_t size) {
+    auto file = strrchr(limit.file, '/');
+    return snprintf(out, size, "suppressed %u messages from %s:%d", suppressed,
+                    file ? file + 1 : limit.file, limit.line);
+}
+
+// native journal protocol is only used when systemd connected stdout to the journal
+int journal_open() {
+    auto stream = getenv("JOURNAL_STREAM");
+    unsigned long dev, ino;
+    struct stat st = {};
+    if(stream == nullptr || sscanf(stream, "%lu:%lu", &dev, &ino) != 2 ||
+       fstat(STDOUT_FILENO, &st) < 0 || st.st_dev != dev || st.st_ino != ino) {
+        return -1;
+    }
+
+    journalAddress = {};
+    journalAddress.sun_family = AF_UNIX;
+    strcpy(journalAddress.sun_path, "/run/systemd/journal/socket");
+    return socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+}
+
+void flush_batch() {
+    size_t sent = 0;
+
+    if(journalfd >= 0) {
+        // addressed per datagram so a journald restart does not strand the socket
+        iovec iov[batch_entries];
+        mmsghdr msgs[batch_entries] = {};
+        for(size_t i = 0; i < entryCount; i++) {
+            iov[i].iov_base = batch + entries[i].offset;
+            iov[i].iov_len = entries[i].size;
+            msgs[i].msg_hdr.msg_name = &journalAddress;
+            msgs[i].msg_hdr.msg_namelen = sizeof(journalAddress);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        while(sent < entryCount) {
+            int rs = sendmmsg(journalfd, msgs + sent, (unsigned int)(entryCount - sent), 0);
+            if(rs < 0) {
+                if(errno == EINTR) continue;
+                break;
+            }
+            sent += rs;
+        }
 
+        // whatever the journal did not take still goes to stdout
+        for(size_t i = sent; i < entryCount; i++) {
+            batch[entries[i].message + entries[i].messageLen] = '\n';
+            write_all(batch + entries[i].message, entries[i].messageLen + 1);
+        }
+    }
+    else {
+        write_all(batch, batchUsed);
+    }
+
+    batchUsed = 0;
+    entryCount = 0;
+}
+
+void emit(int level, const char *message, size_t len, const char *fields, size_t fieldsLen) {
+    if(batchUsed + len + fieldsLen + 128 > sizeof(batch) || entryCount == batch_entries) {
+        flush_batch();
+    }
+
+    char *out = batch + batchUsed;
+    if(journalfd < 0) {
+        memcpy(out, message, len);
+        out[len] = '\n';
+        batchUsed += len + 1;
+        return;
+    }
+
+    auto &entry = entries[entryCount++];
+    entry.offset = batchUsed;
+    out += sprintf(out, "PRIORITY=%d\nSYSLOG_IDENTIFIER=%s\n", level_priorities[level],
+                   program_invocation_short_name);
+    if(memchr(message, '\n', len) == nullptr) {
+        memcpy(out, "MESSAGE=", 8);
+        out += 8;
+    }
+    else {
+        // values containing newlines use the length prefixed binary form
+        uint64_t size = len;
+        memcpy(out, "MESSAGE\n", 8);
+        out += 8;
+        for(int i = 0; i < 8; i++) {
+            *out++ = (char)(size >> (8 * i));
+        }
+    }
+    entry.message = (size_t)(out - batch);
+    entry.messageLen = len;
+    memcpy(out, message, len);
+    out += len;
+    *out++ = '\n';
+    memcpy(out, fields, fieldsLen);
+    out += fieldsLen;
+    entry.size = (size_t)(out - batch) - entry.offset;
+    batchUsed += entry.size;
+}
+
+// copies every pending record into one buffer and writes it; returns the number of records
+size_t drain() {
+    size_t count = 0;
+
+    pthread_mutex_lock(&mutexDrain);
+    for(auto r : rings) {
+        uint32_t dropped = r->dropped.exchange(0, std::memory_order_relaxed);
+        if(dropped > 0) {
+            char temp[64];
+            int len = snprintf(temp, sizeof(temp), "log dropped %u messages", dropped);
+            emit(LOG_LEVEL_NOTICE, temp, (size_t)len, nullptr, 0);
+        }
+
+        uint32_t tail = r->tail.load(std::memory_order_relaxed);
+        uint32_t head = r->head.load(std::memory_order_acquire);
+        for(; tail != head; tail++) {
+            auto &rec = r->records[tail & (ring_records - 1)];
+            emit(rec.level, rec.text, rec.message, rec.text + rec.message, rec.len - rec.message);
+            count++;
+        }
+        r->tail.store(tail, std::memory_order_release);
+    }
+
+    // call sites that went quiet still owe a summary for their last window
+    uint64_t time = now();
+    for(auto limit : limits) {
+        uint32_t suppressed = limit_roll(*limit, time);
+        if(suppressed > 0) {
+            char temp[128];
+            int len = limit_summary(*limit, suppressed, temp, sizeof(temp));
+            emit(limit->level, temp, (size_t)std::min(len, (int)sizeof(temp) - 1), nullptr, 0);
+        }
+    }
+    pthread_mutex_unlock(&mutexDrain);
+
+    if(batchUsed > 0) {
+        flush_batch();
+    }
+    return count;
+}
+
+// when the next window of a call site with suppressed messages ends, 0 if there is none
+uint64_t limit_due() {
+    // caller must hold mutexDrain
+    uint64_t due = 0;
+    for(auto limit : limits) {
+        if(limit->count.load(std::memory_order_relaxed) <= limit_burst) continue;
+        uint64_t end = limit->window.load(std::memory_order_relaxed) + limit_window;
+        if(due == 0 || end < due) due = end;
+    }
+    return due;
+}
+
+// a sleeping drainer is woken for the first record, a busy one picks it up on its next pass
+void wake() {
+    // the fence pairs with the drainer's, either it sees the new work or this sees it idle
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(drainerIdle.load(std::memory_order_relaxed) && drainerIdle.exchange(false)) {
+        pthread_mutex_lock(&mutexDrain);
+        pthread_cond_signal(&condDrain);
+        pthread_mutex_unlock(&mutexDrain);
+    }
+}
+
+bool pending() {
+    // caller must hold mutexDrain
+    for(auto r : rings) {
+        if(r->head.load(std::memory_order_acquire) != r->tail.load(std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void *drain_thread(void *) {
+    for(;;) {
+        if(drain() > 0) continue;
+        if(stopping) break;
+
+        // sleeps until a producer finds it idle, or until a suppressed call site owes its
+        // summary; the fence pairs with the producer's so a new record is either seen
+        // here or the producer sees the idle flag and signals
+        pthread_mutex_lock(&mutexDrain);
+        drainerIdle = true;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(!pending() && !stopping) {
+            uint64_t due = limit_due();
+            if(due == 0) {
+                pthread_cond_wait(&condDrain, &mutexDrain);
+            }
+            else {
+                // a tick of slack, the coarse clock must have passed the window end on waking
+                uint64_t delay = (due > now() ? due - now() : 0) + 10000000;
+                timespec deadline = {};
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += (time_t)(delay / 1000000000);
+                deadline.tv_nsec += (long)(delay % 1000000000);
+                if(deadline.tv_nsec >= 1000000000) {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000;
+                }
+                pthread_cond_timedwait(&condDrain, &mutexDrain, &deadline);
+            }
+        }
+        drainerIdle = false;
+        pthread_mutex_unlock(&mutexDrain);
+    }
+    drain();
+    return nullptr;
+}
+
+void log_stop() {
+    // later messages are written synchronously
+    running = false;
+    pthread_mutex_lock(&mutexDrain);
+    stopping = true;
+    pthread_cond_signal(&condDrain);
+    pthread_mutex_unlock(&mutexDrain);
+    pthread_join(drainer, nullptr);
+}
+
+void log_start() {
+    journalfd = journal_open();
+
+    // the drainer must never take signals meant for the event loop
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    bool started = pthread_create(&drainer, nullptr, drain_thread, nullptr) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+
+    if(started) {
+        running = true;
+        atexit(log_stop);
+    }
+}
+
+log_ring *attach() {
+    ring = new log_ring();
+    pthread_mutex_lock(&mutexDrain);
+    rings.push_back(ring);
+    pthread_mutex_unlock(&mutexDrain);
+    return ring;
+}
+
+// journal field lines for `fields`, nothing unless the journal sink is in use
+size_t format_fields(const log_fields *fields, char *out, size_t size) {
+    if(fields == nullptr || journalfd < 0) return 0;
+
+    size_t len = 0;
+    auto add = [&](int rs) {
+        if(rs > 0 && len + rs < size) len += rs;
+        else out[len] = 0;
+    };
+    if(fields->device >= 0) {
+        add(snprintf(out + len, size - len, "DEVICE_ID=%d\n", fields->device));
+    }
+    if(fields->room) {
+        add(snprintf(out + len, size - len, "ROOM=%s\n", fields->room));
+    }
+    if(fields->level >= 0) {
+        add(snprintf(out + len, size - len, "LEVEL=%d.%02d\n", fields->level / 100, fields->level % 100));
+    }
+    if(fields->event) {
+        add(snprintf(out + len, size - len, "EVENT=%s\n", fields->event));
+    }
+    return len;
+}
+
+void log_append(int level, const log_fields *fields, const char *format, va_list args) {
+    pthread_once(&once, log_start);
+
+    if(!running) {
+        static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
         pthread_mutex_lock(&mutex);
-        vfprintf(stdout, format, argptr);
+        vfprintf(stdout, format, args);
         fwrite("\n", 1, 1, stdout);
         fflush(stdout);
         pthread_mutex_unlock(&mutex);
+        return;
+    }
+
+    auto r = ring ? ring : attach();
+    uint32_t head = r->head.load(std::memory_order_relaxed);
+    uint32_t used = head - r->tail.load(std::memory_order_acquire);
+    if(used >= ring_records) {
+        r->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    // fields are kept whole, the message is truncated to what is left of the record
+    auto &rec = r->records[head & (ring_records - 1)];
+    char extra[128];
+    size_t extraLen = format_fields(fields, extra, sizeof(extra));
+    size_t room = sizeof(rec.text) - extraLen;
+    int len = vsnprintf(rec.text, room, format, args);
+    if(len < 0) len = 0;
+    if(len >= (int)room) len = (int)room - 1;
+    memcpy(rec.text + len, extra, extraLen);
+    rec.message = (uint16_t)len;
+    rec.len = (uint16_t)(len + extraLen);
+    rec.level = (uint8_t)level;
+    r->head.store(head + 1, std::memory_order_release);
+
+    wake();
+}
+
+}
+
+void log_set_level(int level) {
+    if(level < LOG_LEVEL_ERROR) level = LOG_LEVEL_ERROR;
+    if(level > LOG_LEVEL_DEBUG) level = LOG_LEVEL_DEBUG;
+    if(level > LOG_LEVEL_MAX) {
+        log_write(LOG_LEVEL_ERROR, "log level %s is compiled out, using %s",
+                  level_names[level], level_names[LOG_LEVEL_MAX]);
+        level = LOG_LEVEL_MAX;
+    }
+    log_level.store(level, std::memory_order_relaxed);
+}
+
+const char * log_level_name(int level) {
+    if(level < LOG_LEVEL_ERROR || level > LOG_LEVEL_DEBUG) return "unknown";
+    return level_names[level];
+}
 
-        va_end(argptr);
+bool log_parse_level(const char *name, size_t len, int &level) {
+    for(int i = LOG_LEVEL_ERROR; i <= LOG_LEVEL_DEBUG; i++) {
+        if(strlen(level_names[i]) == len && memcmp(level_names[i], name, len) == 0) {
+            level = i;
+            return true;
+        }
     }
+    return false;
+}
+
+bool log_limit_allow(log_limit &limit) {
+    uint32_t suppressed = limit_roll(limit, now());
+    if(suppressed > 0) {
+        char temp[128];
+        limit_summary(limit, suppressed, temp, sizeof(temp));
+        log_write(limit.level, "%s", temp);
+    }
+
+    uint32_t count = limit.count.fetch_add(1, std::memory_order_relaxed);
+    if(count < limit_burst) {
+        return true;
+    }
+    if(!limit.registered.load(std::memory_order_relaxed) && !limit.registered.exchange(true)) {
+        pthread_mutex_lock(&mutexDrain);
+        limits.push_back(&limit);
+        pthread_mutex_unlock(&mutexDrain);
+    }
+    // the drainer has to learn when this window's summary is due
+    if(count == limit_burst) {
+        wake();
+    }
+    return false;
+}
+
+void log_write(int level, const char* format, ...)
+{
+    va_list argptr;
+    va_start(argptr, format);
+    log_append(level, nullptr, format, argptr);
+    va_end(argptr);
+}
+
+void log_write(int level, const log_fields &fields, const char* format, ...)
+{
+    va_list argptr;
+    va_start(argptr, format);
+    log_append(level, &fields, format, argptr);
+    va_end(argptr);
 }
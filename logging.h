@@ -5,14 +5,80 @@
 #ifndef LUTRON_INTEGRATION_LOGGING_H
 #define LUTRON_INTEGRATION_LOGGING_H
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
 #include <string>
 
-void log_debug (const char *format, ...) __attribute__ ((__format__ (__printf__, 1, 2)));
-void log_notice(const char *format, ...) __attribute__ ((__format__ (__printf__, 1, 2)));
-void log_error (const char *format, ...) __attribute__ ((__format__ (__printf__, 1, 2)));
+// a message is written when its level is at or below the current level
+#define LOG_LEVEL_ERROR     0
+#define LOG_LEVEL_NOTICE    1
+#define LOG_LEVEL_DEBUG     2
 
-inline void log_debug (const std::string& text) { log_debug ("%s", text.c_str()); }
-inline void log_notice(const std::string& text) { log_notice("%s", text.c_str()); }
-inline void log_error (const std::string& text) { log_error ("%s", text.c_str()); }
+// messages above this level are compiled out, e.g. -DLOG_LEVEL_MAX=LOG_LEVEL_NOTICE
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LOG_LEVEL_DEBUG
+#endif
+
+extern std::atomic<int> log_level;
+
+// structured fields for the journal, unset members are left out of the entry
+struct log_fields {
+    int device;             // DEVICE_ID, negative when unset
+    const char *room;       // ROOM
+    int32_t level;          // LEVEL in hundredths of a percent, negative when unset
+    const char *event;      // EVENT
+};
+
+void log_set_level(int level);
+const char * log_level_name(int level);
+bool log_parse_level(const char *name, size_t len, int &level);
+
+void log_write(int level, const char *format, ...) __attribute__ ((__format__ (__printf__, 2, 3)));
+void log_write(int level, const log_fields &fields, const char *format, ...)
+        __attribute__ ((__format__ (__printf__, 3, 4)));
+inline void log_write(int level, const std::string& text) { log_write(level, "%s", text.c_str()); }
+
+// arguments are only evaluated when the message will actually be written;
+// journal fields may be passed ahead of the format, log_notice(fields, "...")
+#define LOG_AT(level, ...) do { \
+        if((level) <= LOG_LEVEL_MAX && (level) <= log_level.load(std::memory_order_relaxed)) { \
+            log_write(level, __VA_ARGS__); \
+        } \
+    } while(0)
+
+#define log_error(...)  LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_notice(...) LOG_AT(LOG_LEVEL_NOTICE, __VA_ARGS__)
+#define log_debug(...)  LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+// state for one rate limited call site, see the *_limited macros
+struct log_limit {
+    const int level;
+    const char * const file;
+    const int line;
+    std::atomic<uint64_t> window;       // start of the current window, ns
+    std::atomic<uint32_t> count;        // messages seen in the current window
+    std::atomic<bool> registered;       // known to the drainer, which reports sites that went quiet
+
+    constexpr log_limit(int level, const char *file, int line) :
+            level(level), file(file), line(line), window(0), count(0), registered(false) {}
+};
+
+// true while the call site is within its burst for the current window
+bool log_limit_allow(log_limit &limit);
+
+// writes the first few messages of a call site per window, then only counts them;
+// the count is reported as a "suppressed" summary once the window is over
+#define LOG_LIMITED(level, ...) do { \
+        static log_limit _log_limit(level, __FILE__, __LINE__); \
+        if((level) <= LOG_LEVEL_MAX && (level) <= log_level.load(std::memory_order_relaxed) && \
+           log_limit_allow(_log_limit)) { \
+            log_write(level, __VA_ARGS__); \
+        } \
+    } while(0)
+
+#define log_error_limited(...)  LOG_LIMITED(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_notice_limited(...) LOG_LIMITED(LOG_LEVEL_NOTICE, __VA_ARGS__)
+#define log_debug_limited(...)  LOG_LIMITED(LOG_LEVEL_DEBUG, __VA_ARGS__)
 
 #endif //LUTRON_INTEGRATION_LOGGING_H
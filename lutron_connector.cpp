@@ -2,25 +2,34 @@
 // Created by robert on 5/11/18.
 //
 
+#include <algorithm>
 #include <cstring>
+#include <cstdlib>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <zconf.h>
-#include <csignal>
 #include "lutron_connector.h"
 #include "logging.h"
 
 static const char promptLogin[] = "login: ";
 static const char promptPassword[] = "password: ";
 static const char promptCommand[] = "GNET> ";
+static const char replyError[] = "~ERROR";
 
-LutronConnector::LutronConnector(const char *host, int port, const char *user, const char *pass) :
-    hostname{0}, username{0}, password{0}, threadRX{},
-    mutex(PTHREAD_MUTEX_INITIALIZER),
-    mutexSend(PTHREAD_MUTEX_INITIALIZER),
-    condResponse(PTHREAD_COND_INITIALIZER),
-    condSend(PTHREAD_COND_INITIALIZER)
+// reconnect timing in nanoseconds
+static const uint64_t backoffInitial = 50000000ull;
+static const uint64_t backoffMaximum = 30000000000ull;
+static const uint64_t loginTimeout = 5000000000ull;
+
+// the bridge answers within tens of milliseconds, silence this long means the link is dead
+static const uint64_t responseTimeout = 2000000000ull;
+
+LutronConnector::LutronConnector(EventLoop *evloop, const char *host, int port, const char *user, const char *pass) :
+    hostname{0}, username{0}, password{0},
+    mutexSend(PTHREAD_MUTEX_INITIALIZER)
 {
+    this->loop = evloop;
     this->port = port;
 
     strncpy(hostname, host, sizeof(hostname));
@@ -33,136 +42,348 @@ LutronConnector::LutronConnector(const char *host, int port, const char *user, c
     password[sizeof(password)-1] = 0;
 
     callback = nullptr;
+    readyCallback = nullptr;
     sockfd = -1;
     telnet = nullptr;
-    joinRX = false;
-    doLogin = true;
-    doPassword = true;
-    ready = false;
-    connected = false;
+    state = link_down;
+    active = false;
+    closing = false;
+    pumpPosted = false;
+    receiving = false;
+    outputOffset = 0;
+    events = 0;
+
+    bzero(&address, sizeof(address));
+    resolved = false;
+    backoff = backoffInitial;
+    timerLink = 0;
+    timerResponse = 0;
+    lastResponse = 0;
+    jitterSeed = (unsigned int)EventLoop::now();
+
+    pipelineDepth = 4;
+    seqNext = 1;
+
+    rate = 0;
+    burst = 1;
+    tokens = 1;
+    tokensUpdated = EventLoop::now();
+    timerThrottle = 0;
 }
 
 LutronConnector::~LutronConnector() {
-    pthread_mutex_lock(&mutex);
-    if(sockfd >= 0) {
-        disconnect();
-    }
-    if(joinRX) {
-        pthread_kill(threadRX, SIGINT);
-        pthread_join(threadRX, nullptr);
-    }
-    pthread_mutex_unlock(&mutex);
+    disconnect();
 }
 
 void LutronConnector::setCallback(callback_t cb) {
     this->callback = cb;
 }
 
-bool LutronConnector::disconnect() {
-    pthread_mutex_lock(&mutex);
+void LutronConnector::setReadyCallback(ready_callback_t cb) {
+    this->readyCallback = cb;
+}
 
+void LutronConnector::setPipelineDepth(size_t depth) {
     pthread_mutex_lock(&mutexSend);
-    connected = false;
-    pthread_cond_broadcast(&condSend);
+    pipelineDepth = depth < 1 ? 1 : depth;
     pthread_mutex_unlock(&mutexSend);
+}
 
-    telnet_free(telnet);
-    close(sockfd);
-    sockfd = -1;
-
-    pthread_mutex_unlock(&mutex);
-    return true;
+void LutronConnector::setRateLimit(double r, double b) {
+    pthread_mutex_lock(&mutexSend);
+    rate = r > 0 ? r : 0;
+    burst = b < 1 ? 1 : b;
+    tokens = burst;
+    tokensUpdated = EventLoop::now();
+    pthread_mutex_unlock(&mutexSend);
 }
 
-bool LutronConnector::connect() {
-    pthread_mutex_lock(&mutex);
-    ready = false;
-    connected = false;
+bool LutronConnector::disconnect() {
+    if(!active) {
+        return false;
+    }
 
-    if(joinRX) {
-        pthread_join(threadRX, nullptr);
-        joinRX = false;
+    if(timerLink) {
+        loop->cancelTimer(timerLink);
+        timerLink = 0;
+    }
+    if(timerThrottle) {
+        loop->cancelTimer(timerThrottle);
+        timerThrottle = 0;
     }
+    teardown();
+    state = link_down;
 
-    // create network socket
-    sockfd = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if(sockfd < 0) {
-        log_error("smart bridge connect() failed to create network socket");
-        pthread_mutex_unlock(&mutex);
-        return false;
+    std::vector<command_t> done;
+    pthread_mutex_lock(&mutexSend);
+    active = false;
+    dropCommands(done);
+    pthread_mutex_unlock(&mutexSend);
+    completeCommands(done);
+    return true;
+}
+
+bool LutronConnector::connect() {
+    if(active) {
+        return true;
     }
 
     // resolve network address
-    struct sockaddr_in addr = {};
-    bzero((char *) &addr, sizeof(addr));
-    addr.sin_family = AF_INET;
     struct hostent *server = gethostbyname(hostname);
     if (server) {
-        memcpy(&addr.sin_addr.s_addr, server->h_addr, (size_t)server->h_length);
-        addr.sin_port = htons((uint16_t)port);
+        address.sin_family = AF_INET;
+        memcpy(&address.sin_addr.s_addr, server->h_addr, (size_t)server->h_length);
+        address.sin_port = htons((uint16_t)port);
+        resolved = true;
     }
     else {
         log_error("smart bridge connect() failed to resolve network address");
-        close(sockfd);
-        pthread_mutex_unlock(&mutex);
         return false;
     }
 
-    // connect to remote host
-    auto serv_addr = (const struct sockaddr *) &addr;
-    if (::connect(sockfd, serv_addr, sizeof(struct sockaddr_in)) < 0) {
-        log_error("smart bridge connect() failed to connect to smart bridge %s:%d", hostname, port);
-        close(sockfd);
-        pthread_mutex_unlock(&mutex);
-        return false;
+    // the link is supervised from here on, failures are retried with backoff
+    pthread_mutex_lock(&mutexSend);
+    active = true;
+    pthread_mutex_unlock(&mutexSend);
+    backoff = backoffInitial;
+    startConnect();
+    return true;
+}
+
+void LutronConnector::startConnect() {
+    // re-resolve in case the bridge moved while we were down
+    if(!resolved) {
+        struct hostent *server = gethostbyname(hostname);
+        if (server) {
+            memcpy(&address.sin_addr.s_addr, server->h_addr, (size_t)server->h_length);
+            resolved = true;
+        }
+        else {
+            linkLost("failed to resolve network address");
+            return;
+        }
     }
 
-    static const telnet_telopt_t telopts[] = {
-            { TELNET_TELOPT_ECHO,		TELNET_WONT, TELNET_DONT },
-            { TELNET_TELOPT_TTYPE,		TELNET_WONT, TELNET_DONT },
-            { TELNET_TELOPT_COMPRESS2,	TELNET_WONT, TELNET_DONT },
-            { TELNET_TELOPT_MSSP,		TELNET_WONT, TELNET_DONT },
-            { -1, 0, 0 }
-    };
+    // create network socket
+    sockfd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if(sockfd < 0) {
+        linkLost("failed to create network socket");
+        return;
+    }
 
-    // telnet protocol processor
-    telnet = telnet_init(telopts, telnet_event, 0, this);
+    // writes are already batched per pump, do not let nagle hold them back
+    int one = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 
-    // start network RX thread
-    doLogin = true;
-    doPassword = true;
-    joinRX = true;
-    connected = true;
-    pthread_create(&threadRX, nullptr, doRX, this);
-    pthread_mutex_unlock(&mutex);
+    // a bridge that vanishes without a FIN or RST is noticed even while the link is idle
+    int idle = 10, interval = 2, count = 3, unacked = 5000;
+    setsockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+    setsockopt(sockfd, IPPROTO_TCP, TCP_USER_TIMEOUT, &unacked, sizeof(unacked));
 
-    pthread_mutex_lock(&mutexSend);
-    while(connected && !ready) {
-        pthread_cond_wait(&condSend, &mutexSend);
+    // connect to remote host
+    auto serv_addr = (const struct sockaddr *) &address;
+    if (::connect(sockfd, serv_addr, sizeof(struct sockaddr_in)) < 0 && errno != EINPROGRESS) {
+        linkLost(strerror(errno));
+        return;
     }
-    pthread_mutex_unlock(&mutexSend);
-    return connected;
+
+    state = link_connecting;
+    loop->addHandler(sockfd, EPOLLOUT, onSocket, this);
+    timerLink = loop->addTimer(loginTimeout, onTimeout, this);
 }
 
-void* LutronConnector::doRX(void *context) {
+void LutronConnector::onSocket(void *context, uint32_t events) {
     auto ctx = (LutronConnector *) context;
     ssize_t rs;
     char buffer[256];
 
-    while(ctx->sockfd >= 0) {
-        if ((rs = ::recv(ctx->sockfd, buffer, sizeof(buffer), 0)) > 0) {
+    if(ctx->state == link_connecting) {
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+        getsockopt(ctx->sockfd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+        if(err != 0) {
+            ctx->linkLost(strerror(err));
+            return;
+        }
+
+        static const telnet_telopt_t telopts[] = {
+                { TELNET_TELOPT_ECHO,		TELNET_WONT, TELNET_DONT },
+                { TELNET_TELOPT_TTYPE,		TELNET_WONT, TELNET_DONT },
+                { TELNET_TELOPT_COMPRESS2,	TELNET_WONT, TELNET_DONT },
+                { TELNET_TELOPT_MSSP,		TELNET_WONT, TELNET_DONT },
+                { -1, 0, 0 }
+        };
+
+        // telnet protocol processor
+        ctx->telnet = telnet_init(telopts, telnet_event, 0, ctx);
+        ctx->state = link_login;
+        ctx->events = EPOLLIN;
+        ctx->loop->modifyHandler(ctx->sockfd, EPOLLIN);
+        log_notice("smart bridge connected to %s:%d", ctx->hostname, ctx->port);
+        return;
+    }
+
+    // output the socket would not take earlier
+    if(events & EPOLLOUT) {
+        ctx->flushOutput();
+    }
+
+    if(events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        if ((rs = ::recv(ctx->sockfd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+            // everything written in response to this read goes out together
+            ctx->receiving = true;
             telnet_recv(ctx->telnet, buffer, (size_t)rs);
+            ctx->receiving = false;
+            ctx->flushOutput();
         } else if (rs == 0) {
-            break;
-        } else {
-            if(errno != EINTR) {
-                log_error("smart bridge recv() failed: %s", strerror(errno));
+            log_error("smart bridge closed the connection");
+            ctx->closing = true;
+        } else if (errno != EINTR && errno != EAGAIN) {
+            log_error("smart bridge recv() failed: %s", strerror(errno));
+            ctx->closing = true;
+        }
+    }
+
+    // the telnet processor must not be freed from inside telnet_recv()
+    if(ctx->closing) {
+        ctx->linkLost("connection lost");
+    }
+}
+
+void LutronConnector::onClose(void *context) {
+    auto ctx = (LutronConnector *) context;
+    if(ctx->closing) {
+        ctx->linkLost("connection lost");
+    }
+}
+
+void LutronConnector::onTimeout(void *context) {
+    auto ctx = (LutronConnector *) context;
+    ctx->timerLink = 0;
+    ctx->linkLost("login timed out");
+}
+
+void LutronConnector::onResponseTimeout(void *context) {
+    auto ctx = (LutronConnector *) context;
+    pthread_mutex_lock(&ctx->mutexSend);
+    ctx->timerResponse = 0;
+    if(ctx->state != link_ready || ctx->inFlight.empty()) {
+        pthread_mutex_unlock(&ctx->mutexSend);
+        return;
+    }
+
+    // the bridge made progress since the timer was armed, wait for the new deadline
+    if(ctx->responseDeadline() > EventLoop::now()) {
+        ctx->armResponseTimer();
+        pthread_mutex_unlock(&ctx->mutexSend);
+        return;
+    }
+    pthread_mutex_unlock(&ctx->mutexSend);
+
+    ctx->linkLost("response timeout");
+}
+
+void LutronConnector::onRetry(void *context) {
+    auto ctx = (LutronConnector *) context;
+    ctx->timerLink = 0;
+    log_notice("smart bridge reconnecting to %s:%d", ctx->hostname, ctx->port);
+    ctx->startConnect();
+}
+
+void LutronConnector::fail() {
+    if(!closing) {
+        closing = true;
+        loop->post(onClose, this);
+    }
+}
+
+void LutronConnector::teardown() {
+    if(timerResponse) {
+        loop->cancelTimer(timerResponse);
+        timerResponse = 0;
+    }
+    if(sockfd >= 0) {
+        loop->removeHandler(sockfd);
+        close(sockfd);
+        sockfd = -1;
+    }
+    if(telnet) {
+        telnet_free(telnet);
+        telnet = nullptr;
+    }
+    framer.clear();
+    output.clear();
+    outputOffset = 0;
+    events = 0;
+    closing = false;
+}
+
+void LutronConnector::linkUp() {
+    if(timerLink) {
+        loop->cancelTimer(timerLink);
+        timerLink = 0;
+    }
+    backoff = backoffInitial;
+    log_notice("smart bridge ready");
+
+    pthread_mutex_lock(&mutexSend);
+    state = link_ready;
+    pumpCommands();
+    pthread_mutex_unlock(&mutexSend);
+
+    // devices may have changed while the link was down
+    if(readyCallback) (*readyCallback)();
+}
+
+void LutronConnector::linkLost(const char *reason) {
+    if(!active) return;
+    if(timerLink) {
+        loop->cancelTimer(timerLink);
+        timerLink = 0;
+    }
+    teardown();
+
+    // a connect attempt that failed may mean the bridge has a new address, look it up again
+    if(state <= link_connecting) {
+        resolved = false;
+    }
+
+    // replay anything the bridge did not acknowledge once the link is back
+    std::vector<command_t> done;
+    pthread_mutex_lock(&mutexSend);
+    state = link_backoff;
+    while(!inFlight.empty()) {
+        auto &cmd = inFlight.back();
+        if(cmd.output >= 0) {
+            // a newer level for the output is already waiting, the replayed one is moot
+            bool stale = false;
+            for(auto &levels : unsentLevels) {
+                stale = stale || levels.count(cmd.output) > 0;
             }
-            break;
+            if(stale) {
+                cmd.result.coalesced = true;
+                cmd.result.completed = EventLoop::now();
+                done.push_back(std::move(cmd));
+                inFlight.pop_back();
+                continue;
+            }
+            // unsent again, so a later level for the output can still replace it
+            unsentLevels[cmd.priority][cmd.output] = cmd.result.seq;
         }
+        queued[cmd.priority].push_front(std::move(cmd));
+        inFlight.pop_back();
     }
+    pthread_mutex_unlock(&mutexSend);
+    completeCommands(done);
 
-    return nullptr;
+    // full jitter on the upper half keeps a fleet of clients from retrying in lockstep
+    uint64_t delay = backoff / 2 + (uint64_t)rand_r(&jitterSeed) % (backoff / 2 + 1);
+    backoff = backoff * 2 > backoffMaximum ? backoffMaximum : backoff * 2;
+    log_error("smart bridge link down (%s), retrying in %0.3f s", reason, delay / 1e9);
+    timerLink = loop->addTimer(delay, onRetry, this);
 }
 
 void LutronConnector::telnet_event(telnet_t *telnet, telnet_event_t *event, void *context) {
@@ -210,8 +431,9 @@ void LutronConnector::telnet_event(telnet_t *telnet, telnet_event_t *event, void
             /* error */
 
         case TELNET_EV_ERROR:
-            log_error("smart bridge telnet error: %s", event->error.msg);
-            ctx->disconnect();
+            log_error_limited("smart bridge telnet error: %s", event->error.msg);
+            ctx->fail();
+            break;
 
         default:
             /* ignore */
@@ -220,106 +442,385 @@ void LutronConnector::telnet_event(telnet_t *telnet, telnet_event_t *event, void
 }
 
 void LutronConnector::send(const char *data, size_t len) {
-    ssize_t rs;
+    // collect encoded output, flushOutput() writes it with a single send()
+    if(!closing) {
+        output.append(data, len);
+    }
+}
 
-    /* send data */
-    while (len > 0) {
-        if ((rs = ::send(sockfd, data, len, 0)) == -1) {
-            log_error("smart bridge send() failed: %s", strerror(errno));
-            disconnect();
-        } else if (rs == 0) {
-            log_error("smart bridge send() unexpectedly returned zero");
-            disconnect();
+void LutronConnector::flushOutput() {
+    // the socket stays non-blocking, whatever it does not take waits for EPOLLOUT
+    while(outputOffset < output.size() && !closing) {
+        auto rs = ::send(sockfd, output.data() + outputOffset, output.size() - outputOffset, MSG_NOSIGNAL);
+        if(rs < 0) {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+            log_error_limited("smart bridge send() failed: %s", strerror(errno));
+            fail();
+            break;
         }
+        outputOffset += rs;
+    }
 
-        /* update pointer and size to see if we've got more to send */
-        data += rs;
-        len -= rs;
+    if(closing || outputOffset == output.size()) {
+        output.clear();
+        outputOffset = 0;
+    }
+
+    uint32_t want = outputOffset < output.size() ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    if(sockfd >= 0 && !closing && want != events) {
+        events = want;
+        loop->modifyHandler(sockfd, events);
     }
 }
 
 void LutronConnector::recv(const char *data, size_t len) {
-    if(doLogin) {
-        if(len != sizeof(promptLogin)-1 || strncmp(data, promptLogin, len) != 0) {
-            log_error("smart bridge login prompt not received");
-            disconnect();
-            return;
-        }
-        telnet_send(telnet, username, strlen(username));
-        telnet_send(telnet, "\r\n", 2);
-        doLogin = false;
-        log_notice("smart bridge login sent");
-        return;
+    if(!framer.write(data, len)) {
+        log_error_limited("smart bridge sent an oversized line, discarded");
     }
-    if(doPassword) {
-        if(len != sizeof(promptPassword)-1 || strncmp(data, promptPassword, len) != 0) {
-            log_error("smart bridge password prompt not received");
-            disconnect();
-            return;
+
+    std::vector<command_t> done;
+    LineFramer::slice line = {};
+    while(!closing && framer.next(line)) {
+        if(state == link_ready || state == link_auth) {
+            onLine(line, done);
+        }
+        else {
+            log_debug("smart bridge ignored %.*s", (int)line.size, line.data);
         }
-        telnet_send(telnet, password, strlen(password));
-        telnet_send(telnet, "\r\n", 2);
-        doPassword = false;
-        log_notice("smart bridge password sent");
-        return;
     }
 
-    std::string temp;
-    size_t next = 0;
-    for(;;) {
-        while(next < len && data[next] != '\r' && data[next] != '\n') {
-            next++;
+    // prompts are not line terminated, so look for them in the unterminated remainder
+    while(!closing) {
+        auto tail = framer.pending();
+        if(state == link_login && tail.equals(promptLogin, sizeof(promptLogin)-1)) {
+            framer.consume(tail.size);
+            telnet_send(telnet, username, strlen(username));
+            telnet_send(telnet, "\r\n", 2);
+            state = link_password;
+            log_notice("smart bridge login sent");
         }
-
-        temp.assign(data, next);
-        if(temp == promptLogin) {
+        else if(state == link_password && tail.equals(promptPassword, sizeof(promptPassword)-1)) {
+            framer.consume(tail.size);
+            telnet_send(telnet, password, strlen(password));
+            telnet_send(telnet, "\r\n", 2);
+            state = link_auth;
+            log_notice("smart bridge password sent");
+        }
+        else if(state >= link_auth && tail.equals(promptLogin, sizeof(promptLogin)-1)) {
+            framer.consume(tail.size);
             log_error("smart bridge login rejected");
-            disconnect();
+            fail();
         }
-        else if(temp == promptCommand) {
-            log_debug("smart bridge ready");
-
-            // notify any blocked senders
-            pthread_mutex_lock(&mutexSend);
-            ready = true;
-            pthread_cond_signal(&condSend);
-            pthread_mutex_unlock(&mutexSend);
+        else if(state >= link_auth && tail.startsWith(promptCommand, sizeof(promptCommand)-1)) {
+            framer.consume(sizeof(promptCommand)-1);
+            onPrompt(done);
         }
         else {
-            pthread_mutex_lock(&mutexSend);
-            pthread_cond_signal(&condResponse);
-            pthread_mutex_unlock(&mutexSend);
-            log_debug("smart bridge recv %s", temp.c_str());
-            if(callback) (*callback)(temp.c_str());
+            break;
         }
+    }
 
-        while(next < len && (data[next] == '\r' || data[next] == '\n')) {
-            next++;
+    completeCommands(done);
+}
+
+void LutronConnector::onLine(LineFramer::slice line, std::vector<command_t> &done) {
+    // the bridge prints its prompt without a line break, so when commands
+    // are pipelined the next reply arrives on the same line as the prompt
+    while(line.startsWith(promptCommand, sizeof(promptCommand)-1)) {
+        onPrompt(done);
+        line.data += sizeof(promptCommand)-1;
+        line.size -= sizeof(promptCommand)-1;
+    }
+    if(line.size == 0) {
+        return;
+    }
+
+    log_debug("smart bridge recv %.*s", (int)line.size, line.data);
+
+    // attach replies for the oldest in-flight command
+    pthread_mutex_lock(&mutexSend);
+    if(!inFlight.empty()) {
+        auto &cmd = inFlight.front();
+        bool isError = line.startsWith(replyError, sizeof(replyError)-1);
+        LineFramer::slice body = {line.data + 1, line.size - 1};
+        if(isError || (line.data[0] == '~' && body.startsWith(cmd.match.data(), cmd.match.size()))) {
+            if(!cmd.result.response.empty()) cmd.result.response += '\n';
+            cmd.result.response.append(line.data, line.size);
+            if(isError) cmd.result.success = false;
         }
-        if(next >= len) break;
-        data += next;
-        len -= next;
-        next = 0;
     }
+    pthread_mutex_unlock(&mutexSend);
+
+    if(callback) (*callback)(line.data, line.size);
 }
 
-bool LutronConnector::sendCommand(const char *cmd) {
+void LutronConnector::onPrompt(std::vector<command_t> &done) {
+    if(state != link_ready) {
+        linkUp();
+        return;
+    }
+
     pthread_mutex_lock(&mutexSend);
-    while(connected && !ready) {
-        pthread_cond_wait(&condSend, &mutexSend);
+    // each prompt terminates the oldest in-flight command
+    if(!inFlight.empty()) {
+        auto &cmd = inFlight.front();
+        cmd.result.completed = EventLoop::now();
+        lastResponse = cmd.result.completed;
+        done.push_back(std::move(cmd));
+        inFlight.pop_front();
+    }
+    pumpCommands();
+    pthread_mutex_unlock(&mutexSend);
+}
+
+static int levelOutput(const char *text) {
+    // #OUTPUT,<id>,1,<level>... sets a level, later ones make earlier ones moot
+    if(strncmp(text, "#OUTPUT,", 8) != 0) return -1;
+    char *end;
+    long id = strtol(text + 8, &end, 10);
+    if(end == text + 8 || strncmp(end, ",1,", 3) != 0) return -1;
+    return (int)id;
+}
+
+uint64_t LutronConnector::enqueueCommand(const char *text, completion_t completion, void *context,
+                                         priority_t priority, std::vector<command_t> &done) {
+    // caller must hold mutexSend
+    int output = levelOutput(text);
+    uint64_t now = EventLoop::now();
+
+    // a level still waiting in the same lane is overwritten in place, keeping its seq and
+    // position; one waiting in another lane is stale and is dropped so it cannot land last
+    auto &lane = queued[priority];
+    auto &levels = unsentLevels[priority];
+    for(int p = 0; output >= 0 && p < prio_count; p++) {
+        auto it = unsentLevels[p].find(output);
+        if(it == unsentLevels[p].end()) continue;
+
+        auto &q = queued[p];
+        auto pos = std::lower_bound(q.begin(), q.end(), it->second,
+                                    [](const command_t &c, uint64_t seq) { return c.result.seq < seq; });
+        if(pos == q.end() || pos->result.seq != it->second) continue;
+
+        command_t old = *pos;
+        old.result.coalesced = true;
+        old.result.completed = now;
+        done.push_back(std::move(old));
+
+        if(p == priority) {
+            pos->result.command = text;
+            pos->result.queued = now;
+            pos->completion = completion;
+            pos->context = context;
+            return pos->result.seq;
+        }
+
+        q.erase(pos);
+        unsentLevels[p].erase(it);
     }
-    ready = false;
 
-    if(!connected) {
+    command_t cmd;
+    cmd.result.seq = seqNext++;
+    cmd.result.success = true;
+    cmd.result.coalesced = false;
+    cmd.result.command = text;
+    cmd.result.queued = now;
+    cmd.result.sent = 0;
+    cmd.result.completed = 0;
+    cmd.completion = completion;
+    cmd.context = context;
+    cmd.output = output;
+    cmd.priority = priority;
+
+    // replies echo the command keyword and integration id, e.g. ?OUTPUT,3,1 -> ~OUTPUT,3,...
+    const char *key = text;
+    if(*key == '?' || *key == '#') key++;
+    const char *end = strchr(key, ',');
+    if(end) end = strchr(end + 1, ',');
+    cmd.match = end ? std::string(key, end + 1) : std::string(key);
+
+    uint64_t seq = cmd.result.seq;
+    if(output >= 0) {
+        levels[output] = seq;
+    }
+    lane.push_back(std::move(cmd));
+    return seq;
+}
+
+bool LutronConnector::takeToken(double reserve) {
+    // caller must hold mutexSend and run on the event loop thread
+    if(rate <= 0) return true;
+
+    uint64_t now = EventLoop::now();
+    tokens += (now - tokensUpdated) / 1e9 * rate;
+    if(tokens > burst) tokens = burst;
+    tokensUpdated = now;
+
+    if(tokens >= 1 + reserve) {
+        tokens -= 1;
+        return true;
+    }
+
+    // wake up once enough tokens have accumulated
+    if(!timerThrottle) {
+        auto delay = (uint64_t)((1 + reserve - tokens) / rate * 1e9) + 1;
+        timerThrottle = loop->addTimer(delay, onThrottle, this);
+    }
+    return false;
+}
+
+void LutronConnector::onThrottle(void *context) {
+    auto ctx = (LutronConnector *) context;
+    pthread_mutex_lock(&ctx->mutexSend);
+    ctx->timerThrottle = 0;
+    ctx->pumpCommands();
+    pthread_mutex_unlock(&ctx->mutexSend);
+}
+
+void LutronConnector::pumpCommands() {
+    // caller must hold mutexSend and run on the event loop thread
+    while(state == link_ready && !closing && inFlight.size() < pipelineDepth) {
+        int lane = 0;
+        while(lane < prio_count && queued[lane].empty()) lane++;
+        if(lane == prio_count) break;
+
+        // background traffic leaves a window slot and a token free for interactive commands
+        bool background = lane != prio_interactive;
+        if(background && pipelineDepth > 1 && inFlight.size() + 1 >= pipelineDepth) break;
+        if(!takeToken(background && burst >= 2 ? 1 : 0)) break;
+
+        inFlight.push_back(std::move(queued[lane].front()));
+        queued[lane].pop_front();
+
+        // once written the level can no longer be replaced
+        auto output = inFlight.back().output;
+        if(output >= 0) {
+            auto &levels = unsentLevels[lane];
+            auto it = levels.find(output);
+            if(it != levels.end() && it->second == inFlight.back().result.seq) {
+                levels.erase(it);
+            }
+        }
+
+        auto &cmd = inFlight.back().result;
+        cmd.sent = EventLoop::now();
+        log_debug("smart bridge send %s", cmd.command.c_str());
+        telnet_send(telnet, cmd.command.c_str(), cmd.command.size());
+        telnet_send(telnet, "\r\n", 2);
+    }
+
+    armResponseTimer();
+
+    // a pump started by a bridge reply is flushed once the whole read is processed
+    if(!receiving) {
+        flushOutput();
+    }
+}
+
+uint64_t LutronConnector::responseDeadline() const {
+    // caller must hold mutexSend; commands behind the oldest are only waiting their turn,
+    // so the clock runs from whichever came later, its send or the last reply
+    uint64_t since = std::max(inFlight.front().result.sent, lastResponse);
+    return since + responseTimeout;
+}
+
+void LutronConnector::armResponseTimer() {
+    // caller must hold mutexSend and run on the event loop thread
+    if(timerResponse || inFlight.empty()) return;
+
+    uint64_t now = EventLoop::now();
+    uint64_t deadline = responseDeadline();
+    timerResponse = loop->addTimer(deadline > now ? deadline - now : 0, onResponseTimeout, this);
+}
+
+void LutronConnector::dropCommands(std::vector<command_t> &done) {
+    // caller must hold mutexSend; completions report the failure
+    size_t count = inFlight.size();
+    for(auto &lane : queued) {
+        count += lane.size();
+    }
+    if(count > 0) {
+        log_error("smart bridge dropped %ld pending commands", count);
+    }
+
+    uint64_t now = EventLoop::now();
+    auto drop = [&](std::deque<command_t> &q) {
+        for(auto &cmd : q) {
+            cmd.result.success = false;
+            cmd.result.completed = now;
+            done.push_back(std::move(cmd));
+        }
+        q.clear();
+    };
+    drop(inFlight);
+    for(int i = 0; i < prio_count; i++) {
+        drop(queued[i]);
+        unsentLevels[i].clear();
+    }
+}
+
+void LutronConnector::completeCommands(std::vector<command_t> &done) {
+    // invoked without holding mutexSend so completions may submit new commands
+    for(auto &cmd : done) {
+        if(cmd.completion) (*cmd.completion)(cmd.result, cmd.context);
+    }
+    done.clear();
+}
+
+uint64_t LutronConnector::submitCommand(const char *cmd, completion_t completion, void *context, priority_t priority) {
+    pthread_mutex_lock(&mutexSend);
+    if(!active) {
         pthread_mutex_unlock(&mutexSend);
-        return false;
+        return 0;
+    }
+
+    std::vector<command_t> done;
+    uint64_t seq = enqueueCommand(cmd, completion, context, priority, done);
+    schedulePump();
+    completeCommands(done);
+    return seq;
+}
+
+uint64_t LutronConnector::submitBatch(const std::vector<batch_command> &batch, priority_t priority) {
+    pthread_mutex_lock(&mutexSend);
+    if(!active || batch.empty()) {
+        pthread_mutex_unlock(&mutexSend);
+        return 0;
     }
 
-    log_debug("smart bridge send %s", cmd);
-    telnet_send(telnet, cmd, strlen(cmd));
-    telnet_send(telnet, "\r\n", 2);
-    pthread_cond_wait(&condResponse, &mutexSend);
+    std::vector<command_t> done;
+    uint64_t seq = 0;
+    for(auto &cmd : batch) {
+        seq = enqueueCommand(cmd.command.c_str(), cmd.completion, cmd.context, priority, done);
+    }
+    schedulePump();
+    completeCommands(done);
+    return seq;
+}
 
+void LutronConnector::schedulePump() {
+    // caller must hold mutexSend, which is released here
+
+    // the socket is only written from the event loop thread
+    bool wake = false;
+    if(loop->inLoopThread()) {
+        pumpCommands();
+    }
+    else if(!pumpPosted) {
+        pumpPosted = true;
+        wake = true;
+    }
     pthread_mutex_unlock(&mutexSend);
-    return true;
+
+    if(wake) {
+        loop->post(onPump, this);
+    }
+}
+
+void LutronConnector::onPump(void *context) {
+    auto ctx = (LutronConnector *) context;
+    pthread_mutex_lock(&ctx->mutexSend);
+    ctx->pumpPosted = false;
+    ctx->pumpCommands();
+    pthread_mutex_unlock(&ctx->mutexSend);
 }
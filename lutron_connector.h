@@ -6,13 +6,68 @@
 #define LUTRON_INTEGRATION_LUTRON_CONNECTOR_H
 
 
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "event_loop.h"
+#include "line_framer.h"
 #include "libtelnet.h"
 
 class LutronConnector {
 public:
-    typedef void (*callback_t)(const char *message);
+    // bridge traffic classes, lower values are sent first
+    enum priority_t {
+        prio_interactive,   // user driven control
+        prio_automation,    // scenes and schedules
+        prio_refresh,       // state queries and resyncs
+        prio_count
+    };
+
+    typedef void (*callback_t)(const char *message, size_t length);
+    typedef void (*ready_callback_t)();
+
+    struct command_result {
+        uint64_t seq;           // handle returned by submitCommand()
+        bool success;           // false if the bridge replied ~ERROR or the command was dropped
+        bool coalesced;         // replaced by a newer level for the same output before it was sent
+        std::string command;
+        std::string response;   // bridge reply matched to the command, if any
+        uint64_t queued;        // CLOCK_MONOTONIC timestamps in nanoseconds
+        uint64_t sent;
+        uint64_t completed;
+    };
+
+    typedef void (*completion_t)(const command_result &result, void *context);
+
+    struct batch_command {
+        std::string command;
+        completion_t completion;
+        void *context;
+    };
 
 private:
+    enum link_state {
+        link_down,          // not supervised, see connect()/disconnect()
+        link_backoff,       // waiting to retry after a failure
+        link_connecting,    // non-blocking TCP connect in progress
+        link_login,         // waiting for the login prompt
+        link_password,      // waiting for the password prompt
+        link_auth,          // credentials sent, waiting for the command prompt
+        link_ready          // logged in, commands may be written
+    };
+
+    struct command_t {
+        command_result result;
+        std::string match;
+        completion_t completion;
+        void *context;
+        int output;             // integration id of an #OUTPUT level set, -1 otherwise
+        priority_t priority;
+    };
+
     // network configuration
     int port;
     char hostname[256];
@@ -20,25 +75,71 @@ private:
     char password[64];
 
     // connection state
+    EventLoop *loop;
     int sockfd;
     telnet_t *telnet;
-    bool joinRX, doLogin, doPassword, ready, connected;
-    pthread_t threadRX;
-    pthread_mutex_t mutex, mutexSend;
-    pthread_cond_t condSend, condResponse;
+    LineFramer framer;
+    std::string output;     // telnet encoded bytes waiting for the next flush
+    size_t outputOffset;    // bytes of `output` already written
+    uint32_t events;        // epoll interest once connected
+    link_state state;
+    bool active, closing, pumpPosted, receiving;
+    pthread_mutex_t mutexSend;
     callback_t callback;
+    ready_callback_t readyCallback;
 
-    static void * doRX(void *context);
+    // reconnect supervision
+    struct sockaddr_in address;
+    bool resolved;
+    uint64_t backoff, timerLink;
+    uint64_t timerResponse, lastResponse;   // in-flight commands must keep completing
+    unsigned int jitterSeed;
+
+    // command pipeline, one seq-ordered queue per priority
+    std::deque<command_t> queued[prio_count], inFlight;
+    std::map<int, uint64_t> unsentLevels[prio_count];  // integration id -> seq of its queued level set
+    size_t pipelineDepth;
+    uint64_t seqNext;
+
+    // token bucket shared by all priorities, a rate of 0 disables it
+    double rate, burst, tokens;
+    uint64_t tokensUpdated, timerThrottle;
+
+    static void onSocket(void *context, uint32_t events);
+    static void onPump(void *context);
+    static void onClose(void *context);
+    static void onRetry(void *context);
+    static void onTimeout(void *context);
+    static void onResponseTimeout(void *context);
+    static void onThrottle(void *context);
+    void startConnect();
+    void linkUp();
+    void linkLost(const char *reason);
+    void teardown();
     static void telnet_event(telnet_t *telnet, telnet_event_t *event, void *context);
     void recv(const char *data, size_t len);
+    void onLine(LineFramer::slice line, std::vector<command_t> &done);
+    void onPrompt(std::vector<command_t> &done);
     void send(const char *data, size_t len);
+    void flushOutput();
+    void fail();
+    uint64_t enqueueCommand(const char *cmd, completion_t completion, void *context, priority_t priority,
+                            std::vector<command_t> &done);
+    bool takeToken(double reserve);
+    void pumpCommands();
+    uint64_t responseDeadline() const;
+    void armResponseTimer();
+    void schedulePump();
+    void dropCommands(std::vector<command_t> &done);
+    static void completeCommands(std::vector<command_t> &done);
 
 public:
-    LutronConnector(const char *hostname, int port, const char *username, const char *password);
+    LutronConnector(EventLoop *loop, const char *hostname, int port, const char *username, const char *password);
     ~LutronConnector();
 
     bool connect();
     bool disconnect();
+    bool isReady() const { return state == link_ready; }
 
     // getters
     const char * getHostName() const { return hostname; }
@@ -46,9 +147,22 @@ public:
     const char * getUserName() const { return username; }
     const char * getPassword() const { return password; }
 
-    bool sendCommand(const char *data);
+    size_t getPipelineDepth() const { return pipelineDepth; }
+    void setPipelineDepth(size_t depth);
+
+    // commands per second and burst size the bridge is allowed to see
+    double getRate() const { return rate; }
+    double getBurst() const { return burst; }
+    void setRateLimit(double rate, double burst);
+
+    uint64_t submitCommand(const char *data, completion_t completion = nullptr, void *context = nullptr,
+                           priority_t priority = prio_interactive);
+
+    // queues every command at once so they go out as one burst; returns the last seq
+    uint64_t submitBatch(const std::vector<batch_command> &batch, priority_t priority = prio_interactive);
 
     void setCallback(callback_t callback);
+    void setReadyCallback(ready_callback_t callback);
 };
 
 
@@ -0,0 +1,118 @@
+#include <cstring>
+#include "lutron_message.h"
+
+struct keyword_t {
+    const char *name;
+    size_t len;
+    lutron_message::command_t command;
+};
+
+// perfect hash over the known keywords: (k[0] + 5 * (k[1] + k[n-1]) + n) & 15
+static const keyword_t keywords[16] = {
+        { "INTEGRATIONID", 13, lutron_message::cmd_integrationid },
+        { "TIMECLOCK",      9, lutron_message::cmd_timeclock },
+        { "OUTPUT",         6, lutron_message::cmd_output },
+        { "SHADEGRP",       8, lutron_message::cmd_shadegrp },
+        { "AREA",           4, lutron_message::cmd_area },
+        { "MONITORING",    10, lutron_message::cmd_monitoring },
+        { "GROUP",          5, lutron_message::cmd_group },
+        { "SYSTEM",         6, lutron_message::cmd_system },
+        { nullptr,          0, lutron_message::cmd_unknown },
+        { "HVAC",           4, lutron_message::cmd_hvac },
+        { nullptr,          0, lutron_message::cmd_unknown },
+        { nullptr,          0, lutron_message::cmd_unknown },
+        { "DEVICE",         6, lutron_message::cmd_device },
+        { nullptr,          0, lutron_message::cmd_unknown },
+        { "ERROR",          5, lutron_message::cmd_error },
+        { nullptr,          0, lutron_message::cmd_unknown }
+};
+
+static inline lutron_message::command_t classify(const char *k, size_t n) {
+    if(n < 2) return lutron_message::cmd_unknown;
+
+    auto h = ((unsigned)(uint8_t)k[0] + 5u * ((unsigned)(uint8_t)k[1] + (unsigned)(uint8_t)k[n-1]) + n) & 15u;
+    auto &entry = keywords[h];
+    if(entry.len == n && memcmp(entry.name, k, n) == 0) {
+        return entry.command;
+    }
+    return lutron_message::cmd_unknown;
+}
+
+// parses `[-]digits[.digits]` as fixed-point hundredths, stopping at ',' or end
+static inline bool parseFixed(const char *&p, const char *end, int32_t &value) {
+    bool negative = false;
+    int digits = 0;
+    int32_t whole = 0, frac = 0;
+
+    if(p < end && *p == '-') {
+        negative = true;
+        p++;
+    }
+    for(; p < end && *p >= '0' && *p <= '9'; p++) {
+        if(++digits > 7) return false;
+        whole = whole * 10 + (*p - '0');
+    }
+    if(p < end && *p == '.') {
+        int scale = 10;
+        for(p++; p < end && *p >= '0' && *p <= '9'; p++) {
+            // precision beyond hundredths is truncated
+            if(scale > 0) {
+                frac += (*p - '0') * scale;
+                scale /= 10;
+            }
+            digits++;
+        }
+    }
+    if(digits == 0 || (p < end && *p != ',')) return false;
+
+    value = whole * lutron_message::fixed_one + frac;
+    if(negative) value = -value;
+    return true;
+}
+
+lutron_message::parse_result lutron_message::parse(const char *data, size_t len, lutron_message &msg) {
+    msg.command = cmd_unknown;
+    msg.fields = 0;
+    msg.argc = 0;
+    msg.id = 0;
+    msg.action = 0;
+
+    if(len < 2 || data[0] != '~') {
+        return parse_not_system;
+    }
+
+    const char *p = data + 1;
+    const char *end = data + len;
+    const char *keyword = p;
+    while(p < end && *p != ',') p++;
+
+    msg.command = classify(keyword, (size_t)(p - keyword));
+    if(msg.command == cmd_unknown) {
+        return parse_unknown_command;
+    }
+
+    // p rests on a separator or the end of the message
+    while(p < end) {
+        int32_t value;
+        p++;
+        if(!parseFixed(p, end, value)) {
+            return parse_corrupt;
+        }
+
+        if(msg.fields == 0) {
+            msg.id = value / fixed_one;
+        }
+        else if(msg.fields == 1) {
+            msg.action = value / fixed_one;
+        }
+        else if(msg.argc < max_args) {
+            msg.args[msg.argc++] = value;
+        }
+        else {
+            return parse_corrupt;
+        }
+        msg.fields++;
+    }
+
+    return parse_ok;
+}
@@ -0,0 +1,49 @@
+#ifndef LUTRON_INTEGRATION_LUTRON_MESSAGE_H
+#define LUTRON_INTEGRATION_LUTRON_MESSAGE_H
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Decoded system message from the smart bridge, e.g. `~OUTPUT,3,1,50.00`.
+ * Numeric arguments are fixed-point with two decimal places (50.00 -> 5000).
+ * For `~DEVICE` messages `action` holds the component (button) number and
+ * args[0] holds the button action.
+ */
+struct lutron_message {
+    enum command_t : uint8_t {
+        cmd_unknown,
+        cmd_output,
+        cmd_device,
+        cmd_error,
+        cmd_group,
+        cmd_system,
+        cmd_monitoring,
+        cmd_timeclock,
+        cmd_hvac,
+        cmd_shadegrp,
+        cmd_area,
+        cmd_integrationid
+    };
+
+    enum parse_result {
+        parse_ok,
+        parse_not_system,
+        parse_unknown_command,
+        parse_corrupt
+    };
+
+    static const int max_args = 8;
+    static const int32_t fixed_one = 100;
+
+    command_t command;
+    uint8_t fields;         // numeric fields present, including id and action
+    uint8_t argc;
+    int32_t id;
+    int32_t action;
+    int32_t args[max_args];
+
+    static parse_result parse(const char *data, size_t len, lutron_message &msg);
+};
+
+#endif //LUTRON_INTEGRATION_LUTRON_MESSAGE_H
@@ -5,23 +5,34 @@
 #include <sysexits.h>
 #include <map>
 #include <cstring>
+#include <cinttypes>
 #include <netdb.h>
 #include <csignal>
+#include <sys/signalfd.h>
+#include "event_loop.h"
+#include "device_table.h"
 #include "lutron_connector.h"
 #include "room.h"
+#include "state_store.h"
+#include "status_cache.h"
+#include "subscriber_table.h"
+#include "udp_worker.h"
+#include "stream_server.h"
 #include "logging.h"
 
 #define UNUSED __attribute__((unused))
 
-std::map<int, device *> devices;
-std::map<std::string, device *> deviceNames;
+device_table devices;
+state_store deviceStates;
 std::map<std::string, room *> rooms;
 
+EventLoop eventLoop;
 LutronConnector *lutronBridge;
 
-bool isRunning = true;
-int socketUdp = -1;
-pthread_t threadRx;
+std::vector<UdpWorker *> udpWorkers;
+subscriber_table subscribers;
+StreamServer *streamServer = nullptr;
+int socketSignal = -1;
 
 bool loadConfiguration(json_object *config);
 bool loadConfigurationBridge(json_object *config);
@@ -29,54 +40,75 @@ bool loadConfigurationRooms(json_object *jRooms);
 bool loadConfigurationDevices(json_object *jDevices);
 bool loadConfigurationService(json_object *jService);
 
-static void *doUdpRx(void *obj);
-static json_object* processRequest(json_object *request);
-
-static json_object* doStatus(json_object *request);
-
-void lutronMessage(const char *msg) {
-    char temp[256];
-    strncpy(temp, msg, 255);
-    temp[255] = 0;
-
-    char *fields[16];
-    if(msg[0] != '~') {
-        log_error("ignoring non-system message: %s", msg);
+static void doSignal(void *context, uint32_t events);
+static void processRequest(const service_request &request, std::string &response);
+
+static void resolveTargets(const service_request &request, std::vector<const device *> &targets);
+static void doStatus(const service_request &request, std::string &response);
+static void doSubscribe(const service_request &request, std::string &response);
+static void doSet(const service_request &request, std::string &response);
+static void doLog(const service_request &request, std::string &response);
+static void notifyChange(const device *dev, const lutron_message &message);
+
+void lutronMessage(const char *msg, size_t length) {
+    lutron_message message;
+    switch(lutron_message::parse(msg, length, message)) {
+        case lutron_message::parse_ok:
+            break;
+        case lutron_message::parse_not_system:
+            log_error_limited("ignoring non-system message: %.*s", (int)length, msg);
+            return;
+        case lutron_message::parse_unknown_command:
+            log_debug("ignoring unsupported system message: %.*s", (int)length, msg);
+            return;
+        case lutron_message::parse_corrupt:
+            log_error_limited("corrupt system message: %.*s", (int)length, msg);
+            return;
+    }
+
+    if(message.command == lutron_message::cmd_error) {
+        log_error_limited("smart bridge reported error %d", message.id);
         return;
     }
 
-    int f, i = 1;
-    fields[0] = temp + i;
-    for(f = 0; f < 16 && temp[i] != 0; i++) {
-        if(temp[i] == ',') {
-            temp[i] = 0;
-            fields[++f] = temp+i+1;
-        }
+    if(message.command != lutron_message::cmd_output && message.command != lutron_message::cmd_device) {
+        log_debug("ignoring unsupported system message: %.*s", (int)length, msg);
+        return;
     }
 
-    if(f < 3) {
-        log_error("corrupt system message: %s", msg);
+    if(message.fields < 3) {
+        log_error_limited("corrupt system message: %.*s", (int)length, msg);
         return;
     }
 
-    int devId = (int)strtol(fields[1], nullptr, 10);
-    auto dev = devices.find(devId);
-    if(dev == devices.end()) {
-        log_error("received system message for unknown device: %s", msg);
+    auto dev = devices.find(message.id);
+    if(dev == nullptr) {
+        log_error_limited("received system message for unknown device: %.*s", (int)length, msg);
         return;
     }
 
-    dev->second->processMessage(fields[0], ((const char**)fields)+2, f-2);
+    dev->processMessage(message);
+    notifyChange(dev, message);
 }
 
-void sig_ignore(UNUSED int sig) {}
+void lutronReady() {
+    // resync every device each time the bridge (re)connects
+    log_notice("requesting current device states");
+    for(auto dev : devices) {
+        dev->requestRefresh();
+    }
+}
 
 int main(int argc, char **argv) {
-    struct sigaction act = {};
-    memset(&act, 0, sizeof(act));
-    act.sa_handler = sig_ignore;
-    sigaction(SIGINT, &act, nullptr);
-    sigaction(SIGTERM, &act, nullptr);
+    // shutdown signals are delivered through the event loop
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &mask, nullptr);
+    socketSignal = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    eventLoop.addHandler(socketSignal, EPOLLIN, doSignal, nullptr);
 
     if(argc != 2) {
         log_notice("Usage: lutron-integration <config_json_path>");
@@ -99,46 +131,84 @@ int main(int argc, char **argv) {
     log_notice("finished loading configuration");
     log_notice("smartBridge.hostname = %s", lutronBridge->getHostName());
     log_notice("smartBridge.port = %d", lutronBridge->getPort());
+    log_notice("smartBridge.pipeline = %ld", lutronBridge->getPipelineDepth());
+    if(lutronBridge->getRate() > 0) {
+        log_notice("smartBridge.rate = %0.1f/s, burst %0.0f", lutronBridge->getRate(), lutronBridge->getBurst());
+    }
+    else {
+        log_notice("smartBridge.rate = unlimited");
+    }
     log_debug("smartBridge.username = %s", lutronBridge->getUserName());
     log_debug("smartBridge.password = %s", lutronBridge->getPassword());
     log_notice("registered %ld rooms", rooms.size());
     log_notice("registered %ld devices", devices.size());
 
     lutronBridge->setCallback(lutronMessage);
-    lutronBridge->connect();
-    log_notice("smart bridge connection ready");
-
-    log_notice("start udp rx thread");
-    pthread_create(&threadRx, nullptr, doUdpRx, nullptr);
+    lutronBridge->setReadyCallback(lutronReady);
+    if(!lutronBridge->connect()) {
+        log_error("failed to start smart bridge connection");
+        return EX_UNAVAILABLE;
+    }
+
+    // the first worker shares the main loop, the rest get their own threads
+    log_notice("start udp service with %ld workers", udpWorkers.size());
+    for(size_t i = 0; i < udpWorkers.size(); i++) {
+        if(!(i == 0 ? udpWorkers[i]->attach(&eventLoop) : udpWorkers[i]->start())) {
+            log_error("failed to start udp worker %ld", i);
+            return EX_OSERR;
+        }
+    }
 
-    // update all device states
-    log_notice("requesting current device states");
-    for(auto &dev : devices) {
-        dev.second->requestRefresh();
+    if(streamServer && !streamServer->attach(&eventLoop)) {
+        log_error("failed to start stream service");
+        return EX_OSERR;
     }
 
-    //lutronBridge->sendCommand("?OUTPUT,3");
-    //lutronBridge->sendCommand("?OUTPUT,3,1");
-    //lutronBridge->sendCommand("#OUTPUT,3,1,50,00:00");
-    //lutronBridge->sendCommand("#OUTPUT,3,1,01,00:00");
-    //lutronBridge->sendCommand("?OUTPUT,3,1");
+    // change notifications leave through the first shard's socket, i.e. the service port
+    subscribers.setSocket(udpWorkers[0]->getSocket());
 
-    pause();
-    isRunning = false;
+    eventLoop.run();
     log_notice("shutting down");
 
+    // request handlers submit to the bridge, so every worker is joined before it goes away
+    subscribers.setSocket(-1);
+    for(auto worker : udpWorkers) {
+        delete worker;
+    }
+    udpWorkers.clear();
+    log_notice("udp service stopped");
+
+    if(streamServer) {
+        delete streamServer;
+        streamServer = nullptr;
+        log_notice("stream service stopped");
+    }
+
     log_notice("disconnect from smart bridge");
     lutronBridge->disconnect();
     delete lutronBridge;
 
-    pthread_kill(threadRx, SIGINT);
-    pthread_join(threadRx, nullptr);
-    log_notice("udp rx thread stopped");
-
-    close(socketUdp);
+    close(socketSignal);
     return 0;
 }
 
+static void doSignal(UNUSED void *context, UNUSED uint32_t events) {
+    struct signalfd_siginfo info = {};
+    static int previousLevel = LOG_LEVEL_NOTICE;
+    while(read(socketSignal, &info, sizeof(info)) == sizeof(info)) {
+        if(info.ssi_signo == SIGUSR1) {
+            // toggles debug tracing, back to whatever level was set before
+            int level = log_level.load() == LOG_LEVEL_DEBUG ? previousLevel : LOG_LEVEL_DEBUG;
+            previousLevel = log_level.load();
+            log_set_level(level);
+            log_write(LOG_LEVEL_NOTICE, "log level set to %s", log_level_name(log_level.load()));
+            continue;
+        }
+        log_notice("received signal %d", info.ssi_signo);
+        eventLoop.stop();
+    }
+}
+
 bool loadConfiguration(json_object *config) {
     json_object *jtmp;
 
@@ -187,7 +257,8 @@ bool loadConfiguration(json_object *config) {
 
 bool loadConfigurationBridge(json_object *config) {
     json_object *jtmp;
-    int port = 23;
+    int port = 23, pipeline = 4;
+    double rate = 0, burst = -1;
     const char *host = nullptr, *user = "lutron", *pass = "integration";
 
     if(json_object_object_get_ex(config, "host", &jtmp)) {
@@ -210,7 +281,31 @@ bool loadConfigurationBridge(json_object *config) {
         pass = json_object_get_string(jtmp);
     }
 
-    lutronBridge = new LutronConnector(host, port, user, pass);
+    if(json_object_object_get_ex(config, "pipeline", &jtmp)) {
+        pipeline = json_object_get_int(jtmp);
+        if(pipeline < 1) {
+            log_error("configuration `smartBridge` section has invalid `pipeline` depth: %d", pipeline);
+            return false;
+        }
+    }
+
+    // commands per second the bridge is fed; off unless configured, the pipeline
+    // depth already bounds how much the bridge has outstanding
+    if(json_object_object_get_ex(config, "rate", &jtmp)) {
+        rate = json_object_get_double(jtmp);
+    }
+
+    // defaults to one second worth of commands
+    if(json_object_object_get_ex(config, "burst", &jtmp)) {
+        burst = json_object_get_double(jtmp);
+    }
+    if(burst < 0) {
+        burst = rate;
+    }
+
+    lutronBridge = new LutronConnector(&eventLoop, host, port, user, pass);
+    lutronBridge->setPipelineDepth((size_t)pipeline);
+    lutronBridge->setRateLimit(rate, burst);
     return true;
 }
 
@@ -262,28 +357,25 @@ bool loadConfigurationDevices(json_object *jDevices) {
         if(dev == nullptr) {
             return false;
         }
-        if(devices.find(dev->id) != devices.end()) {
-            log_error("device entry is already defined: %d", dev->id);
-            delete dev;
-            return false;
-        }
-        if(deviceNames.find(dev->name) != deviceNames.end()) {
-            log_error("device entry is already defined: %s", dev->name.c_str());
+        if(!devices.add(dev)) {
             delete dev;
             return false;
         }
-        devices[dev->id] = dev;
-        deviceNames[dev->name] = dev;
         dev->conn = lutronBridge;
     }
 
+    devices.finalize();
+    deviceStates.resize(devices.size());
+    for(auto dev : devices) {
+        dev->states = &deviceStates;
+    }
     return true;
 }
 
 bool loadConfigurationService(json_object *jService) {
     json_object *jtmp;
-    std::string bindAddress;
-    int bindPort;
+    std::string bindAddress, socketPath;
+    int bindPort, streamPort = 0, workers = 1;
 
     if(json_object_object_get_ex(jService, "address", &jtmp)) {
         bindAddress = json_object_get_string(jtmp);
@@ -301,6 +393,14 @@ bool loadConfigurationService(json_object *jService) {
         return false;
     }
 
+    if(json_object_object_get_ex(jService, "workers", &jtmp)) {
+        workers = json_object_get_int(jtmp);
+        if(workers < 1) {
+            log_error("`service` section has invalid `workers` count: %d", workers);
+            return false;
+        }
+    }
+
     struct hostent *server = gethostbyname(bindAddress.c_str());
     if(!server) {
         log_error("could not resolve bind address: %s", bindAddress.c_str());
@@ -313,117 +413,301 @@ bool loadConfigurationService(json_object *jService) {
     memcpy(&sockAddr.sin_addr.s_addr, server->h_addr, (size_t)server->h_length);
     sockAddr.sin_port = htons(bindPort);
 
-    socketUdp = socket(AF_INET, SOCK_DGRAM, 0);
-    if(socketUdp < 0) {
-        log_error("failed to create socket");
-        return false;
+    // every worker binds its own socket, the kernel shards clients across them
+    for(int i = 0; i < workers; i++) {
+        auto worker = new UdpWorker(processRequest);
+        if(!worker->bind(sockAddr, workers > 1)) {
+            delete worker;
+            return false;
+        }
+        udpWorkers.push_back(worker);
     }
 
-    if (bind(socketUdp, (struct sockaddr *) &sockAddr, sizeof(sockAddr)) < 0) {
-        log_error("ERROR on socket binding! %s (%d)", strerror(errno), errno);
-        close(socketUdp);
-        return EX_CANTCREAT;
+    log_notice("listening on %s:%d", bindAddress.c_str(), bindPort);
+
+    // optional stream listeners for local and bulk clients
+    if(json_object_object_get_ex(jService, "streamPort", &jtmp)) {
+        streamPort = json_object_get_int(jtmp);
+    }
+    if(json_object_object_get_ex(jService, "socket", &jtmp)) {
+        socketPath = json_object_get_string(jtmp);
     }
 
-    log_notice("listening on %s:%d", bindAddress.c_str(), bindPort);
+    if(streamPort > 0 || !socketPath.empty()) {
+        streamServer = new StreamServer(processRequest);
+    }
+
+    if(streamPort > 0) {
+        sockAddr.sin_port = htons(streamPort);
+        if(!streamServer->listenTcp(sockAddr)) {
+            return false;
+        }
+        log_notice("listening on %s:%d/tcp", bindAddress.c_str(), streamPort);
+    }
+
+    if(!socketPath.empty()) {
+        if(!streamServer->listenUnix(socketPath.c_str())) {
+            return false;
+        }
+        log_notice("listening on %s", socketPath.c_str());
+    }
     return true;
 }
 
-static void *doUdpRx(UNUSED void *obj) {
-    auto tokener = json_tokener_new_ex(8);
-    sockaddr_in remoteAddr = {};
-    socklen_t addrLen;
-    char buffer[65536];
+static void serializeResponse(json_object *jResponse, std::string &response) {
+    response = json_object_to_json_string_ext(jResponse, JSON_C_TO_STRING_PLAIN);
+    json_object_put(jResponse);
+}
 
-    // strict parsing only
-    json_tokener_set_flags(tokener, JSON_TOKENER_STRICT);
+static void processRequest(const service_request &request, std::string &response) {
+    if(request.encoding == service_request::enc_binary) {
+        switch(request.action) {
+            case service_request::act_none:
+                request.encodeError(service_request::err_malformed, response);
+                return;
+            case service_request::act_status:
+                doStatus(request, response);
+                return;
+            default:
+                request.encodeError(service_request::err_unknown_opcode, response);
+                return;
+        }
+    }
 
-    while(isRunning && socketUdp >= 0) {
-        bzero(&remoteAddr, sizeof(remoteAddr));
-        addrLen = sizeof(remoteAddr);
-        ssize_t r = recvfrom(socketUdp, buffer, sizeof(buffer), 0, (struct sockaddr *) &remoteAddr, &addrLen);
-        if(r > 0) {
-            auto request = json_tokener_parse_ex(tokener, buffer, (int)r);
-            auto response = processRequest(request);
-            json_object_put(request);
+    switch(request.action) {
+        case service_request::act_none:
+            response = "null";
+            return;
+        case service_request::act_status:
+            doStatus(request, response);
+            return;
+        case service_request::act_subscribe:
+            doSubscribe(request, response);
+            return;
+        case service_request::act_set:
+            doSet(request, response);
+            return;
+        case service_request::act_log:
+            doLog(request, response);
+            return;
+        default:
+            break;
+    }
+
+    auto jResponse = json_object_new_object();
+    json_object_object_add(jResponse, "error", json_object_new_string("invalid action"));
+    serializeResponse(jResponse, response);
+}
 
-            auto responseStr = json_object_to_json_string_ext(response, JSON_C_TO_STRING_PLAIN);
-            sendto(socketUdp, responseStr, strlen(responseStr), 0, (struct sockaddr *) &remoteAddr, sizeof(remoteAddr));
-            json_object_put(request);
+static void resolveTargets(const service_request &request, std::vector<const device *> &targets) {
+    targets.clear();
+
+    // every device of a room is one contiguous slice of the room index
+    for(int i = 0; i < request.roomCount; i++) {
+        auto &t = request.rooms[i];
+        if(t.name == nullptr) continue;
+        auto loc = devices.findRoom(t.name, t.len);
+        if(loc != nullptr) {
+            auto range = devices.inRoom(loc);
+            targets.insert(targets.end(), range.begin(), range.end());
         }
     }
 
-    json_tokener_free(tokener);
-    return nullptr;
+    for(int i = 0; i < request.deviceCount; i++) {
+        auto &t = request.devices[i];
+        device *target = t.name ? devices.find(t.name, t.len) : devices.find(t.id);
+        if(target != nullptr) {
+            targets.push_back(target);
+        }
+    }
 }
 
-static json_object* processRequest(json_object *request) {
-    json_object *jAction;
-    if(!json_object_object_get_ex(request, "action", &jAction)) return nullptr;
-    auto action = json_object_get_string(jAction);
+static void doStatus(const service_request &request, std::string &response) {
+    // every worker thread renders from its own cache
+    static thread_local status_cache cache(devices, deviceStates);
+    static thread_local std::vector<const device *> targets;
+    bool filtered = request.hasRooms || request.hasDevices;
+    resolveTargets(request, targets);
 
-    if(strcmp(action, "status") == 0){
-        return doStatus(request);
+    if(request.encoding == service_request::enc_binary) {
+        if(filtered) {
+            cache.renderPacked(request.requestId, targets, response);
+        }
+        else {
+            cache.renderPacked(request.requestId, response);
+        }
+        return;
     }
 
-    auto response = json_object_new_object();
-    json_object_object_add(response, "error", json_object_new_string("invalid action"));
-    return response;
+    // without a filter the whole house is reported from the cached reply
+    if(filtered) {
+        cache.render(targets, response);
+    }
+    else {
+        cache.render(response);
+    }
 }
 
-static json_object* doStatus(json_object *request) {
-    json_object *jList, *jtmp;
-    std::set<device *> statDevices;
+static void doSubscribe(const service_request &request, std::string &response) {
+    static thread_local std::vector<const device *> targets;
+    static thread_local std::vector<int> ids;
 
-    // check for list of rooms
-    if(json_object_object_get_ex(request, "rooms", &jList)) {
+    // notifications are datagrams, stream clients have no address to push them to
+    if(request.remote == nullptr) {
+        response = "{\"error\":\"subscribe is only available over udp\"}";
+        return;
+    }
 
+    resolveTargets(request, targets);
+    ids.clear();
+    for(auto dev : targets) {
+        ids.push_back(dev->id);
     }
 
-    // check for list of devices
-    if(json_object_object_get_ex(request, "devices", &jList)) {
-        int len = json_object_array_length(jList);
-        for(int i = 0; i < len; i++) {
-            device *target = nullptr;
-            jtmp = json_object_array_get_idx(jList, i);
-            if(json_object_get_type(jtmp) == json_type_int) {
-                auto d = devices.find(json_object_get_int(jtmp));
-                if(d != devices.end()) {
-                    target = d->second;
-                }
-            }
-            else {
-                auto deviceName = json_object_get_string(jtmp);
-                for (auto d : devices) {
-                    if (d.second->name == deviceName) {
-                        target = d.second;
-                        break;
-                    }
-                }
-            }
+    // a filter that matches nothing would hold a lease that never hears anything
+    bool filtered = request.hasDevices || request.hasRooms;
+    int ttl = request.hasTtl ? request.ttl : subscriber_table::default_ttl;
+    if(filtered && ids.empty() && ttl > 0) {
+        response = "{\"error\":\"filter matches no devices\"}";
+        return;
+    }
+
+    ttl = subscribers.subscribe(*request.remote, ttl, filtered, ids);
+    if(ttl < 0) {
+        response = "{\"error\":\"too many subscribers\"}";
+        return;
+    }
+
+    char temp[64];
+    int len = snprintf(temp, sizeof(temp), "{\"type\":\"subscribed\",\"ttl\":%d}", ttl);
+    response.assign(temp, (size_t)len);
+}
 
-            if(target != nullptr) {
-                statDevices.insert(target);
+static void doSet(const service_request &request, std::string &response) {
+    // pending level per device slot, so the last change for a device wins
+    static thread_local std::vector<device *> order;
+    static thread_local std::vector<int32_t> levels, fades;
+    static thread_local std::vector<uint8_t> pending;
+    static thread_local std::vector<LutronConnector::batch_command> batch;
+    static thread_local std::vector<device *> targets;
+    static thread_local std::vector<device_table::device_range> ranges;
+
+    if(pending.size() != devices.size()) {
+        pending.assign(devices.size(), 0);
+        levels.assign(devices.size(), 0);
+        fades.assign(devices.size(), 0);
+    }
+    order.clear();
+
+    // every change is resolved, and the whole request rejected, before any device is marked pending
+    targets.assign((size_t)request.changeCount, nullptr);
+    ranges.clear();
+    for(int i = 0; i < request.changeCount; i++) {
+        auto &c = request.changes[i];
+        if(!c.hasLevel) {
+            response = "{\"error\":\"change is missing `level`\"}";
+            return;
+        }
+
+        device_table::device_range range = {nullptr, nullptr};
+        if(c.isRoom) {
+            if(c.dev.name) range = devices.inRoom(devices.findRoom(c.dev.name, c.dev.len));
+        }
+        else {
+            targets[i] = c.dev.name ? devices.find(c.dev.name, c.dev.len) : devices.find(c.dev.id);
+            if(targets[i]) range = {&targets[i], &targets[i] + 1};
+        }
+
+        if(range.size() == 0) {
+            response = "{\"error\":\"change has no known `device` or `room`\"}";
+            return;
+        }
+        ranges.push_back(range);
+    }
+
+    for(int i = 0; i < request.changeCount; i++) {
+        auto &c = request.changes[i];
+        for(auto dev : ranges[i]) {
+            if(!pending[dev->slot]) {
+                pending[dev->slot] = 1;
+                order.push_back(dev);
             }
+            levels[dev->slot] = c.level;
+            fades[dev->slot] = c.fade < 0 ? 1 : c.fade;
         }
     }
 
-    auto jDevices = json_object_new_array();
-    for(auto d : statDevices) {
-        auto jDevice = json_object_new_object();
-        json_object_object_add(jDevice, "id", json_object_new_int(d->id));
-        if(d->type == device::plugin_switch || d->type == device::wall_switch) {
-            auto sw = (device_switch *)d;
-            json_object_object_add(jDevice, "state", json_object_new_string(sw->getState() ? "on" : "off"));
+    // one burst to the bridge for the whole request
+    batch.clear();
+    for(auto dev : order) {
+        pending[dev->slot] = 0;
+        LutronConnector::batch_command cmd;
+        if(dev->applyLevel(levels[dev->slot], fades[dev->slot], cmd)) {
+            batch.push_back(std::move(cmd));
         }
-        else if(d->type == device::plugin_dimmer || d->type == device::wall_dimmer) {
-            auto sw = (device_dimmer *)d;
-            json_object_object_add(jDevice, "level", json_object_new_double(sw->getLevel()));
+    }
+
+    static const LutronConnector::priority_t lanes[] = {
+        LutronConnector::prio_interactive,
+        LutronConnector::prio_automation,
+        LutronConnector::prio_refresh
+    };
+    if(!batch.empty() && lutronBridge->submitBatch(batch, lanes[request.priority]) == 0) {
+        response = "{\"error\":\"smart bridge unavailable\"}";
+        return;
+    }
+
+    char temp[64];
+    int len = snprintf(temp, sizeof(temp), "{\"type\":\"set\",\"queued\":%ld}", batch.size());
+    response.assign(temp, (size_t)len);
+}
+
+static void doLog(const service_request &request, std::string &response) {
+    if(request.hasLogLevel) {
+        if(request.logLevel < 0) {
+            response = "{\"error\":\"invalid level\"}";
+            return;
         }
+        log_set_level(request.logLevel);
+        log_write(LOG_LEVEL_NOTICE, "log level set to %s", log_level_name(log_level.load()));
+    }
+
+    char temp[64];
+    int len = snprintf(temp, sizeof(temp), "{\"type\":\"log\",\"level\":\"%s\"}", log_level_name(log_level.load()));
+    response.assign(temp, (size_t)len);
+}
+
+static void notifyChange(const device *dev, const lutron_message &message) {
+    char temp[128];
+    int len;
+
+    if(message.command == lutron_message::cmd_output && message.action == 1) {
+        if(dev->type == device::plugin_switch || dev->type == device::wall_switch) {
+            len = snprintf(temp, sizeof(temp), "{\"type\":\"change\",\"version\":%" PRIu64 ",\"id\":%d,\"state\":\"%s\"}",
+                           deviceStates.version(), dev->id, deviceStates.getOn(dev->slot) ? "on" : "off");
+        }
+        else if(dev->type == device::plugin_dimmer || dev->type == device::wall_dimmer) {
+            int32_t level = deviceStates.getLevel(dev->slot);
+            len = snprintf(temp, sizeof(temp), "{\"type\":\"change\",\"version\":%" PRIu64 ",\"id\":%d,\"level\":%d.%02d}",
+                           deviceStates.version(), dev->id,
+                           level / lutron_message::fixed_one, level % lutron_message::fixed_one);
+        }
+        else {
+            return;
+        }
+    }
+    else if(message.command == lutron_message::cmd_device && message.argc >= 1) {
+        // button press (3) and release (4)
+        int event = message.args[0] / lutron_message::fixed_one;
+        if(event != 3 && event != 4) {
+            return;
+        }
+        len = snprintf(temp, sizeof(temp), "{\"type\":\"button\",\"id\":%d,\"button\":%d,\"event\":\"%s\"}",
+                       dev->id, message.action, event == 3 ? "press" : "release");
+    }
+    else {
+        return;
     }
 
-    auto response = json_object_new_object();
-    json_object_object_add(response, "type", json_object_new_string("status"));
-    json_object_object_add(response, "devices", jDevices);
-    return response;
+    subscribers.publish(dev->id, temp, (size_t)len);
 }
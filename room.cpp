@@ -7,5 +7,5 @@
 room::room(const char *n, const char *d) :
 name(n), description(d)
 {
-    devices.clear();
+    slot = 0;
 }
@@ -5,16 +5,14 @@
 #ifndef LUTRON_INTEGRATION_ROOM_H
 #define LUTRON_INTEGRATION_ROOM_H
 
-#include "device.h"
-
 #include <string>
-#include <set>
+#include <cstddef>
 
 class room {
 public:
     const std::string name;
     const std::string description;
-    std::set<device *> devices;
+    size_t slot;    // position in the device table's room index
 
     room(const char *name, const char *description);
     ~room() = default;
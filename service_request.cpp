@@ -0,0 +1,430 @@
+#include <cmath>
+#include <cstring>
+#include "service_request.h"
+#include "logging.h"
+
+static bool parsePriority(const char *name, size_t len, service_request::priority_t &priority) {
+    if(len == 11 && memcmp(name, "interactive", 11) == 0) priority = service_request::pri_interactive;
+    else if(len == 10 && memcmp(name, "automation", 10) == 0) priority = service_request::pri_automation;
+    else if(len == 7 && memcmp(name, "refresh", 7) == 0) priority = service_request::pri_refresh;
+    else return false;
+    return true;
+}
+
+static service_request::action_t parseAction(const char *name, size_t len) {
+    if(len == 6 && memcmp(name, "status", 6) == 0) return service_request::act_status;
+    if(len == 9 && memcmp(name, "subscribe", 9) == 0) return service_request::act_subscribe;
+    if(len == 3 && memcmp(name, "set", 3) == 0) return service_request::act_set;
+    if(len == 3 && memcmp(name, "log", 3) == 0) return service_request::act_log;
+    return service_request::act_unknown;
+}
+
+void service_request::clear() {
+    action = act_none;
+    encoding = enc_json;
+    requestId = 0;
+    remote = nullptr;
+    priority = pri_interactive;
+    hasTtl = false;
+    ttl = 0;
+    hasLogLevel = false;
+    logLevel = -1;
+    hasDevices = false;
+    hasRooms = false;
+    deviceCount = 0;
+    roomCount = 0;
+    changeCount = 0;
+}
+
+namespace {
+    // single pass cursor over the request, any surprise sends us to json-c
+    struct cursor {
+        const char *p;
+        const char *end;
+
+        void ws() {
+            while(p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+        }
+
+        bool expect(char c) {
+            ws();
+            if(p < end && *p == c) {
+                p++;
+                return true;
+            }
+            return false;
+        }
+
+        bool peek(char c) {
+            ws();
+            return p < end && *p == c;
+        }
+
+        // plain strings only, escapes and control characters take the slow path
+        bool string(const char *&str, size_t &len) {
+            if(!expect('"')) return false;
+            auto close = (const char *) memchr(p, '"', (size_t)(end - p));
+            if(close == nullptr) return false;
+            for(auto c = p; c < close; c++) {
+                if(*c == '\\' || (uint8_t)*c < 0x20) return false;
+            }
+            str = p;
+            len = (size_t)(close - p);
+            p = close + 1;
+            return true;
+        }
+
+        bool integer(int32_t &value) {
+            ws();
+            bool negative = false;
+            if(p < end && *p == '-') {
+                negative = true;
+                p++;
+            }
+            int digits = 0;
+            int64_t v = 0;
+            for(; p < end && *p >= '0' && *p <= '9'; p++) {
+                if(++digits > 9) return false;
+                v = v * 10 + (*p - '0');
+            }
+            if(digits == 0) return false;
+            if(p < end && (*p == '.' || *p == 'e' || *p == 'E')) return false;
+            value = (int32_t)(negative ? -v : v);
+            return true;
+        }
+
+        // decimal number as fixed-point hundredths, exponents take the slow path
+        bool fixed(int32_t &value) {
+            ws();
+            bool negative = false;
+            if(p < end && *p == '-') {
+                negative = true;
+                p++;
+            }
+            int digits = 0;
+            int64_t v = 0;
+            for(; p < end && *p >= '0' && *p <= '9'; p++) {
+                if(++digits > 7) return false;
+                v = v * 10 + (*p - '0');
+            }
+            if(digits == 0) return false;
+            v *= 100;
+            if(p < end && *p == '.') {
+                p++;
+                int scale = 10, fraction = 0;
+                for(; p < end && *p >= '0' && *p <= '9'; p++) {
+                    if(scale > 0) v += (*p - '0') * scale;
+                    scale /= 10;
+                    fraction++;
+                }
+                if(fraction == 0) return false;
+            }
+            if(p < end && (*p == 'e' || *p == 'E')) return false;
+            value = (int32_t)(negative ? -v : v);
+            return true;
+        }
+
+        bool target(service_request::target &t) {
+            if(peek('"')) {
+                t.id = 0;
+                return string(t.name, t.len);
+            }
+            t.name = nullptr;
+            t.len = 0;
+            return integer(t.id);
+        }
+
+        bool change(service_request::change &c) {
+            c.dev = {0, nullptr, 0};
+            c.isRoom = false;
+            c.hasLevel = false;
+            c.level = 0;
+            c.fade = -1;
+
+            if(!expect('{')) return false;
+            if(expect('}')) return true;
+            do {
+                const char *key;
+                size_t klen;
+                if(!string(key, klen) || !expect(':')) return false;
+
+                if(klen == 6 && memcmp(key, "device", 6) == 0) {
+                    if(!target(c.dev)) return false;
+                    c.isRoom = false;
+                }
+                else if(klen == 4 && memcmp(key, "room", 4) == 0) {
+                    if(!target(c.dev)) return false;
+                    c.isRoom = true;
+                }
+                else if(klen == 5 && memcmp(key, "level", 5) == 0) {
+                    if(!fixed(c.level)) return false;
+                    c.hasLevel = true;
+                }
+                else if(klen == 4 && memcmp(key, "fade", 4) == 0) {
+                    int32_t fade;
+                    if(!fixed(fade)) return false;
+                    c.fade = fade / 100;
+                }
+                else {
+                    return false;
+                }
+            } while(expect(','));
+            return expect('}');
+        }
+
+        bool changes(service_request::change *list, int &count) {
+            count = 0;
+            if(!expect('[')) return false;
+            if(expect(']')) return true;
+            do {
+                if(count == service_request::max_changes) return false;
+                if(!change(list[count++])) return false;
+            } while(expect(','));
+            return expect(']');
+        }
+
+        bool targets(service_request::target *list, int &count) {
+            count = 0;
+            if(!expect('[')) return false;
+            if(expect(']')) return true;
+            do {
+                if(count == service_request::max_targets) return false;
+                if(!target(list[count++])) return false;
+            } while(expect(','));
+            return expect(']');
+        }
+    };
+}
+
+bool service_request::parse(const char *data, size_t len) {
+    clear();
+    cursor c = {data, data + len};
+
+    if(!c.expect('{')) return false;
+    if(!c.expect('}')) {
+        do {
+            const char *key;
+            size_t klen;
+            if(!c.string(key, klen) || !c.expect(':')) return false;
+
+            if(klen == 6 && memcmp(key, "action", 6) == 0) {
+                const char *name;
+                size_t nlen;
+                if(!c.string(name, nlen)) return false;
+                action = parseAction(name, nlen);
+            }
+            else if(klen == 7 && memcmp(key, "devices", 7) == 0) {
+                if(!c.targets(devices, deviceCount)) return false;
+                hasDevices = true;
+            }
+            else if(klen == 5 && memcmp(key, "rooms", 5) == 0) {
+                if(!c.targets(rooms, roomCount)) return false;
+                hasRooms = true;
+            }
+            else if(klen == 7 && memcmp(key, "changes", 7) == 0) {
+                if(!c.changes(changes, changeCount)) return false;
+            }
+            else if(klen == 8 && memcmp(key, "priority", 8) == 0) {
+                const char *name;
+                size_t nlen;
+                if(!c.string(name, nlen)) return false;
+                parsePriority(name, nlen, priority);
+            }
+            else if(klen == 3 && memcmp(key, "ttl", 3) == 0) {
+                if(!c.integer(ttl)) return false;
+                hasTtl = true;
+            }
+            else if(klen == 5 && memcmp(key, "level", 5) == 0) {
+                const char *name;
+                size_t nlen;
+                if(!c.string(name, nlen)) return false;
+                hasLogLevel = true;
+                log_parse_level(name, nlen, logLevel);
+            }
+            else {
+                return false;
+            }
+        } while(c.expect(','));
+        if(!c.expect('}')) return false;
+    }
+
+    c.ws();
+    return c.p == c.end;
+}
+
+static void parseTarget(json_object *jtmp, service_request::target &t) {
+    if(json_object_get_type(jtmp) == json_type_int) {
+        t.id = json_object_get_int(jtmp);
+        t.name = nullptr;
+        t.len = 0;
+    }
+    else {
+        t.id = 0;
+        t.name = json_object_get_string(jtmp);
+        t.len = (size_t)json_object_get_string_len(jtmp);
+    }
+}
+
+static void parseTargets(json_object *jList, service_request::target *list, int &count) {
+    count = 0;
+    int len = json_object_array_length(jList);
+    for(int i = 0; i < len && count < service_request::max_targets; i++) {
+        parseTarget(json_object_array_get_idx(jList, i), list[count++]);
+    }
+}
+
+static void parseChanges(json_object *jList, service_request::change *list, int &count) {
+    json_object *jtmp;
+    count = 0;
+    int len = json_object_array_length(jList);
+    for(int i = 0; i < len && count < service_request::max_changes; i++) {
+        auto jchange = json_object_array_get_idx(jList, i);
+        auto &c = list[count++];
+        c.dev = {0, nullptr, 0};
+        c.isRoom = false;
+        c.hasLevel = false;
+        c.level = 0;
+        c.fade = -1;
+
+        if(json_object_object_get_ex(jchange, "device", &jtmp)) {
+            parseTarget(jtmp, c.dev);
+        }
+        else if(json_object_object_get_ex(jchange, "room", &jtmp)) {
+            parseTarget(jtmp, c.dev);
+            c.isRoom = true;
+        }
+
+        if(json_object_object_get_ex(jchange, "level", &jtmp)) {
+            c.hasLevel = true;
+            c.level = (int32_t)lround(json_object_get_double(jtmp) * 100);
+        }
+
+        if(json_object_object_get_ex(jchange, "fade", &jtmp)) {
+            c.fade = (int32_t)json_object_get_double(jtmp);
+        }
+    }
+}
+
+bool service_request::parse(json_object *request) {
+    json_object *jtmp;
+    clear();
+
+    if(json_object_get_type(request) != json_type_object) {
+        return false;
+    }
+
+    if(json_object_object_get_ex(request, "action", &jtmp)) {
+        action = parseAction(json_object_get_string(jtmp), (size_t)json_object_get_string_len(jtmp));
+    }
+
+    if(json_object_object_get_ex(request, "devices", &jtmp)) {
+        hasDevices = true;
+        parseTargets(jtmp, devices, deviceCount);
+    }
+
+    if(json_object_object_get_ex(request, "rooms", &jtmp)) {
+        hasRooms = true;
+        parseTargets(jtmp, rooms, roomCount);
+    }
+
+    if(json_object_object_get_ex(request, "changes", &jtmp)) {
+        parseChanges(jtmp, changes, changeCount);
+    }
+
+    if(json_object_object_get_ex(request, "priority", &jtmp)) {
+        parsePriority(json_object_get_string(jtmp), (size_t)json_object_get_string_len(jtmp), priority);
+    }
+
+    if(json_object_object_get_ex(request, "ttl", &jtmp)) {
+        hasTtl = true;
+        ttl = json_object_get_int(jtmp);
+    }
+
+    if(json_object_object_get_ex(request, "level", &jtmp)) {
+        hasLogLevel = true;
+        log_parse_level(json_object_get_string(jtmp), (size_t)json_object_get_string_len(jtmp), logLevel);
+    }
+
+    return true;
+}
+
+static inline uint16_t get16(const char *p) {
+    return (uint16_t)(((uint8_t)p[0] << 8) | (uint8_t)p[1]);
+}
+
+bool service_request::parseBinary(const char *data, size_t len) {
+    clear();
+    encoding = enc_binary;
+
+    if(len < binary_header || (uint8_t)data[0] != binary_magic) {
+        return false;
+    }
+
+    requestId = get16(data + 2);
+    auto count = get16(data + 4);
+    if(count > max_targets || len != binary_header + 2 * (size_t)count) {
+        return false;
+    }
+
+    switch((uint8_t)data[1]) {
+        case op_status:
+            action = act_status;
+            break;
+        default:
+            action = act_unknown;
+            return true;
+    }
+
+    hasDevices = count > 0;
+    deviceCount = count;
+    for(int i = 0; i < count; i++) {
+        devices[i].id = get16(data + binary_header + 2 * i);
+        devices[i].name = nullptr;
+        devices[i].len = 0;
+    }
+    return true;
+}
+
+void service_request::encodeError(error_t code, std::string &out) const {
+    char frame[5] = {
+        (char) binary_magic,
+        (char) (op_error | op_reply),
+        (char) (requestId >> 8),
+        (char) requestId,
+        (char) code
+    };
+    out.assign(frame, sizeof(frame));
+}
+
+service_decoder::service_decoder() {
+    dom = nullptr;
+    tokener = json_tokener_new_ex(8);
+    // strict parsing only
+    json_tokener_set_flags(tokener, JSON_TOKENER_STRICT);
+}
+
+service_decoder::~service_decoder() {
+    json_object_put(dom);
+    json_tokener_free(tokener);
+}
+
+const service_request & service_decoder::decode(const char *data, size_t len, const sockaddr_in *remote) {
+    json_object_put(dom);
+    dom = nullptr;
+
+    // binary frames go to the same handler, it answers in the request's encoding
+    if(len > 0 && (uint8_t)data[0] == service_request::binary_magic) {
+        request.parseBinary(data, len);
+    }
+    // the common requests never touch json-c, anything unusual takes the full parser
+    else if(!request.parse(data, len)) {
+        json_tokener_reset(tokener);
+        dom = json_tokener_parse_ex(tokener, data, (int)len);
+        if(dom == nullptr || !request.parse(dom)) {
+            request.clear();
+        }
+    }
+
+    request.remote = remote;
+    return request;
+}
@@ -0,0 +1,133 @@
+#ifndef LUTRON_INTEGRATION_SERVICE_REQUEST_H
+#define LUTRON_INTEGRATION_SERVICE_REQUEST_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <netinet/in.h>
+#include <json-c/json.h>
+
+/**
+ * Decoded service API request, from either JSON or the binary framing.
+ *
+ * Binary frames start with `binary_magic`, which can never begin a JSON
+ * document, so both share the service port. All integers are big-endian.
+ *   request:  magic, opcode, request id (u16), count (u16), ids (u16 * count)
+ *   status:   magic, opcode | op_reply, request id, version (u32), count (u16),
+ *             then id (u16) and level (u16, hundredths of a percent) per device
+ *   error:    magic, op_error | op_reply, request id, error code (u8)
+ * A status request with no ids reports the whole house.
+ *
+ * Names point into the request buffer (or into the json-c tree on the fallback
+ * path) and are only valid while that is alive.
+ */
+struct service_request {
+    enum action_t {
+        act_none,
+        act_unknown,
+        act_status,
+        act_subscribe,
+        act_set,
+        act_log
+    };
+
+    enum encoding_t {
+        enc_json,
+        enc_binary
+    };
+
+    enum opcode_t {
+        op_status = 0x01,
+        op_error = 0x7f,
+        op_reply = 0x80
+    };
+
+    enum error_t {
+        err_malformed = 1,
+        err_unknown_opcode = 2
+    };
+
+    static const uint8_t binary_magic = 0xb1;
+    static const size_t binary_header = 6;
+    static const uint16_t binary_no_level = 0xffff;
+
+    struct target {
+        int32_t id;         // used when name is null
+        const char *name;
+        size_t len;
+    };
+
+    enum priority_t {
+        pri_interactive,
+        pri_automation,
+        pri_refresh
+    };
+
+    // one entry of a `set` request, a device or a whole room
+    struct change {
+        target dev;
+        bool isRoom;
+        bool hasLevel;
+        int32_t level;      // hundredths of a percent
+        int32_t fade;       // seconds, negative for the default
+    };
+
+    static const int max_targets = 128;
+    static const int max_changes = 128;
+
+    action_t action;
+    encoding_t encoding;
+    uint16_t requestId;
+    const sockaddr_in *remote;  // datagram sender, null on stream transports
+    priority_t priority;
+    bool hasTtl;
+    int32_t ttl;
+    bool hasLogLevel;
+    int logLevel;               // LOG_LEVEL_*, -1 for an unknown name
+    bool hasDevices;
+    bool hasRooms;
+    int deviceCount;
+    int roomCount;
+    target devices[max_targets];
+    target rooms[max_targets];
+    int changeCount;
+    change changes[max_changes];
+
+    void clear();
+
+    // fast path for the known schema, returns false for any other shape
+    bool parse(const char *data, size_t len);
+
+    // fallback for requests the fast path does not recognize
+    bool parse(json_object *request);
+
+    // binary frame, `data` must start with binary_magic
+    bool parseBinary(const char *data, size_t len);
+
+    // binary error reply for this request
+    void encodeError(error_t code, std::string &out) const;
+};
+
+// writes the serialized reply for a request into `response`, shared by every transport
+typedef void (*service_handler_t)(const service_request &request, std::string &response);
+
+/**
+ * Decodes raw request bytes for a transport: binary frames, then the fast JSON
+ * path, then json-c. The returned request stays valid until the next decode.
+ * Not thread-safe, each worker or listener owns one.
+ */
+class service_decoder {
+private:
+    json_tokener *tokener;
+    json_object *dom;
+    service_request request;
+
+public:
+    service_decoder();
+    ~service_decoder();
+
+    const service_request & decode(const char *data, size_t len, const sockaddr_in *remote);
+};
+
+
+#endif //LUTRON_INTEGRATION_SERVICE_REQUEST_H
@@ -0,0 +1,138 @@
+#include <json-c/json.h>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sysexits.h>
+#include <csignal>
+#include <sys/signalfd.h>
+#include "event_loop.h"
+#include "bridge_simulator.h"
+#include "logging.h"
+
+#define UNUSED __attribute__((unused))
+
+EventLoop eventLoop;
+int socketSignal = -1;
+
+static void doSignal(UNUSED void *context, UNUSED uint32_t events) {
+    struct signalfd_siginfo info = {};
+    while(read(socketSignal, &info, sizeof(info)) == sizeof(info)) {
+        log_notice("received signal %d", info.ssi_signo);
+        eventLoop.stop();
+    }
+}
+
+static void usage() {
+    log_notice("Usage: lutron-simulator [options] <config_json_path>");
+    log_notice("  -p <port>     listen port, defaults to smartBridge.port");
+    log_notice("  -l <ms>       latency before each reply");
+    log_notice("  -j <ms>       random jitter added to the latency");
+    log_notice("  -f            fragment output into partial reads");
+    log_notice("  -d <s>        mean session lifetime before a forced disconnect");
+    log_notice("  -b <s>        mean interval between keypad button events");
+    log_notice("  -s <seed>     random seed");
+    log_notice("  -v            debug logging");
+}
+
+// zones and keypads come from the same device list the service is configured with
+static bool loadDevices(json_object *jDevices, BridgeSimulator &sim) {
+    if(json_object_get_type(jDevices) != json_type_array) {
+        log_error("configuration `devices` section is not an array");
+        return false;
+    }
+
+    for(size_t i = 0; i < json_object_array_length(jDevices); i++) {
+        json_object *jDevice = json_object_array_get_idx(jDevices, i);
+        json_object *jId, *jType;
+        if(!json_object_object_get_ex(jDevice, "id", &jId) || !json_object_object_get_ex(jDevice, "type", &jType)) {
+            log_error("device entry is missing `id` or `type`");
+            return false;
+        }
+
+        int id = json_object_get_int(jId);
+        const char *type = json_object_get_string(jType);
+        if(strcmp(type, "wall_dimmer") == 0 || strcmp(type, "plugin_dimmer") == 0) {
+            sim.addZone(id, true);
+        }
+        else if(strcmp(type, "wall_switch") == 0 || strcmp(type, "plugin_switch") == 0) {
+            sim.addZone(id, false);
+        }
+        else if(strcmp(type, "pico_remote") == 0) {
+            sim.addKeypad(id);
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    // shutdown signals are delivered through the event loop
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, nullptr);
+    socketSignal = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    eventLoop.addHandler(socketSignal, EPOLLIN, doSignal, nullptr);
+
+    BridgeSimulator::options opts = {};
+    opts.port = -1;
+    opts.seed = (unsigned int) getpid();
+
+    int opt;
+    while((opt = getopt(argc, argv, "p:l:j:fd:b:s:v")) != -1) {
+        switch(opt) {
+            case 'p': opts.port = atoi(optarg); break;
+            case 'l': opts.latency = (uint64_t)(atof(optarg) * 1e6); break;
+            case 'j': opts.jitter = (uint64_t)(atof(optarg) * 1e6); break;
+            case 'f': opts.partial = true; break;
+            case 'd': opts.disconnectMean = (uint64_t)(atof(optarg) * 1e9); break;
+            case 'b': opts.buttonInterval = (uint64_t)(atof(optarg) * 1e9); break;
+            case 's': opts.seed = (unsigned int) strtoul(optarg, nullptr, 10); break;
+            case 'v': log_set_level(LOG_LEVEL_DEBUG); break;
+            default:
+                usage();
+                return EX_USAGE;
+        }
+    }
+
+    if(optind != argc - 1) {
+        usage();
+        return EX_USAGE;
+    }
+
+    json_object *config = json_object_from_file(argv[optind]);
+    if(json_object_get_type(config) != json_type_object) {
+        log_error("failed to load configuration file: %s", argv[optind]);
+        return EX_CONFIG;
+    }
+
+    // credentials and port match what the service will use to log in
+    json_object *jBridge, *jtmp;
+    opts.username = "lutron";
+    opts.password = "integration";
+    int port = 23;
+    if(json_object_object_get_ex(config, "smartBridge", &jBridge)) {
+        if(json_object_object_get_ex(jBridge, "port", &jtmp)) port = json_object_get_int(jtmp);
+        if(json_object_object_get_ex(jBridge, "user", &jtmp)) opts.username = json_object_get_string(jtmp);
+        if(json_object_object_get_ex(jBridge, "password", &jtmp)) opts.password = json_object_get_string(jtmp);
+    }
+    if(opts.port < 0) opts.port = port;
+
+    BridgeSimulator sim(&eventLoop, opts);
+    if(!json_object_object_get_ex(config, "devices", &jtmp) || !loadDevices(jtmp, sim)) {
+        log_error("failed to load configuration file: %s", argv[optind]);
+        return EX_CONFIG;
+    }
+    json_object_put(config);
+
+    if(!sim.start()) {
+        return EX_UNAVAILABLE;
+    }
+
+    eventLoop.run();
+    log_notice("shutting down");
+    sim.stop();
+
+    close(socketSignal);
+    return 0;
+}
@@ -0,0 +1,113 @@
+#include <cstring>
+#include <ctime>
+#include "state_store.h"
+#include "lutron_message.h"
+
+static uint64_t realtimeMillis() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000ull + (uint64_t)ts.tv_nsec / 1000000ull;
+}
+
+state_store::state_store() :
+    sequence(0),
+    mutexWrite(PTHREAD_MUTEX_INITIALIZER)
+{
+    count = 0;
+}
+
+void state_store::resize(size_t n) {
+    count = n;
+    level.assign(n, 0);
+    on.assign(n, 0);
+    changed.assign(n, 0);
+    seq.assign(n, 0);
+}
+
+void state_store::beginWrite() {
+    // caller must hold mutexWrite; odd sequence marks a write in progress
+    sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+void state_store::endWrite() {
+    sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void state_store::setLevel(size_t slot, int32_t l) {
+    if(slot >= count) return;
+    pthread_mutex_lock(&mutexWrite);
+    // repeated reports leave the version alone, so cached replies stay valid
+    if(level[slot] != l || on[slot] != (uint8_t)(l > 0)) {
+        beginWrite();
+        level[slot] = l;
+        on[slot] = (uint8_t)(l > 0);
+        changed[slot] = realtimeMillis();
+        seq[slot]++;
+        endWrite();
+    }
+    pthread_mutex_unlock(&mutexWrite);
+}
+
+void state_store::setOn(size_t slot, bool o) {
+    if(slot >= count) return;
+    int32_t l = o ? 100 * lutron_message::fixed_one : 0;
+    pthread_mutex_lock(&mutexWrite);
+    if(level[slot] != l || on[slot] != (uint8_t)o) {
+        beginWrite();
+        level[slot] = l;
+        on[slot] = (uint8_t)o;
+        changed[slot] = realtimeMillis();
+        seq[slot]++;
+        endWrite();
+    }
+    pthread_mutex_unlock(&mutexWrite);
+}
+
+int32_t state_store::getLevel(size_t slot) const {
+    if(slot >= count) return 0;
+    uint64_t s1, s2;
+    int32_t value;
+    do {
+        s1 = sequence.load(std::memory_order_acquire);
+        value = level[slot];
+        std::atomic_thread_fence(std::memory_order_acquire);
+        s2 = sequence.load(std::memory_order_relaxed);
+    } while((s1 & 1) || s1 != s2);
+    return value;
+}
+
+bool state_store::getOn(size_t slot) const {
+    if(slot >= count) return false;
+    uint64_t s1, s2;
+    bool value;
+    do {
+        s1 = sequence.load(std::memory_order_acquire);
+        value = on[slot] != 0;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        s2 = sequence.load(std::memory_order_relaxed);
+    } while((s1 & 1) || s1 != s2);
+    return value;
+}
+
+void state_store::read(snapshot &out) const {
+    // sized once by the caller's first read, later reads do not allocate
+    out.level.resize(count);
+    out.on.resize(count);
+    out.changed.resize(count);
+    out.seq.resize(count);
+
+    uint64_t s1, s2;
+    do {
+        s1 = sequence.load(std::memory_order_acquire);
+        if(s1 & 1) continue;
+        memcpy(out.level.data(), level.data(), count * sizeof(int32_t));
+        memcpy(out.on.data(), on.data(), count * sizeof(uint8_t));
+        memcpy(out.changed.data(), changed.data(), count * sizeof(uint64_t));
+        memcpy(out.seq.data(), seq.data(), count * sizeof(uint32_t));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        s2 = sequence.load(std::memory_order_relaxed);
+    } while((s1 & 1) || s1 != s2);
+
+    out.version = s1 >> 1;
+}
@@ -0,0 +1,57 @@
+#ifndef LUTRON_INTEGRATION_STATE_STORE_H
+#define LUTRON_INTEGRATION_STATE_STORE_H
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include <pthread.h>
+
+/**
+ * Device state kept as parallel arrays indexed by device slot.
+ * Writers serialize on a mutex and publish through a seqlock, so readers never
+ * block: a snapshot of the whole house is one consistent memcpy per array.
+ */
+class state_store {
+public:
+    struct snapshot {
+        uint64_t version;
+        std::vector<int32_t> level;     // fixed-point hundredths of a percent
+        std::vector<uint8_t> on;
+        std::vector<uint64_t> changed;  // CLOCK_REALTIME milliseconds
+        std::vector<uint32_t> seq;      // per-device change counter
+    };
+
+private:
+    std::atomic<uint64_t> sequence;
+    pthread_mutex_t mutexWrite;
+    size_t count;
+
+    std::vector<int32_t> level;
+    std::vector<uint8_t> on;
+    std::vector<uint64_t> changed;
+    std::vector<uint32_t> seq;
+
+    void beginWrite();
+    void endWrite();
+
+public:
+    state_store();
+    ~state_store() = default;
+
+    // must be called before any reader or writer is started
+    void resize(size_t count);
+    size_t size() const { return count; }
+
+    void setLevel(size_t slot, int32_t level);
+    void setOn(size_t slot, bool on);
+
+    // each read is consistent on its own
+    int32_t getLevel(size_t slot) const;
+    bool getOn(size_t slot) const;
+    uint64_t version() const { return sequence.load(std::memory_order_acquire) >> 1; }
+
+    void read(snapshot &out) const;
+};
+
+
+#endif //LUTRON_INTEGRATION_STATE_STORE_H
@@ -0,0 +1,175 @@
+#include <cinttypes>
+#include <cstdio>
+#include "status_cache.h"
+#include "lutron_message.h"
+#include "service_request.h"
+
+status_cache::status_cache(const device_table &d, const state_store &s) :
+    devices(d), states(s)
+{
+    houseValid = false;
+    houseVersion = 0;
+    packedValid = false;
+    packedVersion = 0;
+}
+
+void status_cache::renderFragment(const device *dev) {
+    char temp[64];
+    int len;
+
+    if(dev->type == device::plugin_switch || dev->type == device::wall_switch) {
+        len = snprintf(temp, sizeof(temp), "{\"id\":%d,\"state\":\"%s\"}",
+                       dev->id, snap.on[dev->slot] ? "on" : "off");
+    }
+    else if(dev->type == device::plugin_dimmer || dev->type == device::wall_dimmer) {
+        int32_t level = snap.level[dev->slot];
+        len = snprintf(temp, sizeof(temp), "{\"id\":%d,\"level\":%d.%02d}",
+                       dev->id, level / lutron_message::fixed_one, level % lutron_message::fixed_one);
+    }
+    else {
+        len = snprintf(temp, sizeof(temp), "{\"id\":%d}", dev->id);
+    }
+
+    auto &frag = fragments[dev->slot];
+    frag.json.assign(temp, (size_t)len);
+    frag.seq = snap.seq[dev->slot];
+    frag.valid = true;
+}
+
+void status_cache::refresh() {
+    if(fragments.size() != states.size()) {
+        fragments.assign(states.size(), {false, 0, std::string()});
+        selected.assign(states.size(), 0);
+    }
+
+    // only devices whose change counter moved are rendered again
+    states.read(snap);
+    for(auto dev : devices) {
+        auto &frag = fragments[dev->slot];
+        if(!frag.valid || frag.seq != snap.seq[dev->slot]) {
+            renderFragment(dev);
+        }
+    }
+}
+
+void status_cache::beginResponse(std::string &out) const {
+    char temp[64];
+    int len = snprintf(temp, sizeof(temp), "{\"type\":\"status\",\"version\":%" PRIu64 ",\"devices\":[", snap.version);
+    out.assign(temp, (size_t)len);
+}
+
+void status_cache::render(std::string &out) {
+    // identical polls between changes are answered by copying bytes
+    if(houseValid && houseVersion == states.version()) {
+        out = house;
+        return;
+    }
+
+    refresh();
+    beginResponse(house);
+    bool first = true;
+    for(auto dev : devices) {
+        if(!first) house += ',';
+        house += fragments[dev->slot].json;
+        first = false;
+    }
+    house += "]}";
+
+    houseVersion = snap.version;
+    houseValid = true;
+    out = house;
+}
+
+void status_cache::render(const std::vector<const device *> &targets, std::string &out) {
+    refresh();
+    beginResponse(out);
+
+    bool first = true;
+    for(auto dev : targets) {
+        if(selected[dev->slot]) continue;
+        selected[dev->slot] = 1;
+        if(!first) out += ',';
+        out += fragments[dev->slot].json;
+        first = false;
+    }
+    out += "]}";
+
+    for(auto dev : targets) {
+        selected[dev->slot] = 0;
+    }
+}
+
+void status_cache::beginPacked(uint16_t requestId, size_t count, std::string &out) const {
+    char header[10] = {
+        (char) service_request::binary_magic,
+        (char) (service_request::op_status | service_request::op_reply),
+        (char) (requestId >> 8),
+        (char) requestId,
+        (char) (snap.version >> 24),
+        (char) (snap.version >> 16),
+        (char) (snap.version >> 8),
+        (char) snap.version,
+        (char) (count >> 8),
+        (char) count
+    };
+    out.reserve(sizeof(header) + 4 * count);
+    out.assign(header, sizeof(header));
+}
+
+void status_cache::appendPacked(const device *dev, std::string &out) const {
+    uint16_t level;
+    if(dev->type == device::plugin_switch || dev->type == device::wall_switch) {
+        level = (uint16_t)(snap.on[dev->slot] ? 100 * lutron_message::fixed_one : 0);
+    }
+    else if(dev->type == device::plugin_dimmer || dev->type == device::wall_dimmer) {
+        level = (uint16_t)snap.level[dev->slot];
+    }
+    else {
+        level = service_request::binary_no_level;
+    }
+
+    char entry[4] = {
+        (char) (dev->id >> 8),
+        (char) dev->id,
+        (char) (level >> 8),
+        (char) level
+    };
+    out.append(entry, sizeof(entry));
+}
+
+void status_cache::renderPacked(uint16_t requestId, std::string &out) {
+    if(!packedValid || packedVersion != states.version()) {
+        states.read(snap);
+        beginPacked(0, devices.size(), packed);
+        for(auto dev : devices) {
+            appendPacked(dev, packed);
+        }
+        packedVersion = snap.version;
+        packedValid = true;
+    }
+
+    out = packed;
+    out[2] = (char) (requestId >> 8);
+    out[3] = (char) requestId;
+}
+
+void status_cache::renderPacked(uint16_t requestId, const std::vector<const device *> &targets, std::string &out) {
+    if(selected.size() != states.size()) {
+        selected.assign(states.size(), 0);
+    }
+    states.read(snap);
+
+    size_t count = 0;
+    for(auto dev : targets) {
+        if(selected[dev->slot]) continue;
+        selected[dev->slot] = 1;
+        count++;
+    }
+
+    beginPacked(requestId, count, out);
+    for(auto dev : targets) {
+        if(!selected[dev->slot]) continue;
+        selected[dev->slot] = 0;
+        appendPacked(dev, out);
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef LUTRON_INTEGRATION_STATUS_CACHE_H
+#define LUTRON_INTEGRATION_STATUS_CACHE_H
+
+#include <string>
+#include <vector>
+#include "device_table.h"
+#include "state_store.h"
+
+/**
+ * Pre-rendered JSON for the `status` action. Each device keeps a fragment that
+ * is only re-rendered when its change counter moves, and the whole-house reply
+ * is kept verbatim until the store version changes. Instances are not shared
+ * between threads; every UDP worker owns one.
+ *
+ * The binary replies are packed straight from the snapshot, the whole-house
+ * frame is kept per version the same way and only its request id is patched.
+ */
+class status_cache {
+private:
+    struct fragment {
+        bool valid;
+        uint32_t seq;
+        std::string json;
+    };
+
+    const device_table &devices;
+    const state_store &states;
+
+    state_store::snapshot snap;
+    std::vector<fragment> fragments;
+    std::vector<uint8_t> selected;
+
+    bool houseValid;
+    uint64_t houseVersion;
+    std::string house;
+
+    bool packedValid;
+    uint64_t packedVersion;
+    std::string packed;
+
+    void refresh();
+    void renderFragment(const device *dev);
+    void beginResponse(std::string &out) const;
+    void beginPacked(uint16_t requestId, size_t count, std::string &out) const;
+    void appendPacked(const device *dev, std::string &out) const;
+
+public:
+    status_cache(const device_table &devices, const state_store &states);
+    ~status_cache() = default;
+
+    // entire house
+    void render(std::string &out);
+
+    // selected devices only, duplicates are ignored
+    void render(const std::vector<const device *> &targets, std::string &out);
+
+    // binary status frames, see service_request
+    void renderPacked(uint16_t requestId, std::string &out);
+    void renderPacked(uint16_t requestId, const std::vector<const device *> &targets, std::string &out);
+};
+
+
+#endif //LUTRON_INTEGRATION_STATUS_CACHE_H
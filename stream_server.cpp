@@ -0,0 +1,270 @@
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "stream_server.h"
+#include "logging.h"
+
+StreamServer::StreamServer(service_handler_t h) {
+    handler = h;
+    loop = nullptr;
+}
+
+StreamServer::~StreamServer() {
+    stop();
+    for(auto l : listeners) {
+        ::close(l->fd);
+        delete l;
+    }
+    if(!unixPath.empty()) {
+        unlink(unixPath.c_str());
+    }
+}
+
+bool StreamServer::listenOn(int fd, const sockaddr *addr, socklen_t len, bool tcp) {
+    if(::bind(fd, addr, len) < 0) {
+        log_error("ERROR on socket binding! %s (%d)", strerror(errno), errno);
+        ::close(fd);
+        return false;
+    }
+
+    if(::listen(fd, 64) < 0) {
+        log_error("failed to listen on stream socket: %s", strerror(errno));
+        ::close(fd);
+        return false;
+    }
+
+    auto l = new listener();
+    l->server = this;
+    l->fd = fd;
+    l->tcp = tcp;
+    listeners.push_back(l);
+    return true;
+}
+
+bool StreamServer::listenTcp(const sockaddr_in &addr) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        log_error("failed to create socket");
+        return false;
+    }
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    return listenOn(fd, (const sockaddr *) &addr, sizeof(addr), true);
+}
+
+bool StreamServer::listenUnix(const char *path) {
+    sockaddr_un addr = {};
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        log_error("unix socket path is too long: %s", path);
+        return false;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        log_error("failed to create socket");
+        return false;
+    }
+
+    // a stale socket from a previous run would make bind fail
+    unlink(path);
+    if(!listenOn(fd, (const sockaddr *) &addr, sizeof(addr), false)) {
+        return false;
+    }
+    chmod(path, 0660);
+    unixPath = path;
+    return true;
+}
+
+bool StreamServer::attach(EventLoop *evloop) {
+    loop = evloop;
+    for(auto l : listeners) {
+        if(!loop->addHandler(l->fd, EPOLLIN, onAccept, l)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void StreamServer::stop() {
+    while(!connections.empty()) {
+        close(connections.begin()->second);
+    }
+    if(loop) {
+        for(auto l : listeners) {
+            loop->removeHandler(l->fd);
+        }
+    }
+    loop = nullptr;
+}
+
+void StreamServer::close(connection *conn) {
+    loop->removeHandler(conn->fd);
+    ::close(conn->fd);
+    connections.erase(conn->fd);
+    delete conn;
+}
+
+void StreamServer::onAccept(void *context, uint32_t events) {
+    auto l = (listener *) context;
+    auto server = l->server;
+
+    for(;;) {
+        int fd = accept4(l->fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_error_limited("stream accept() failed: %s", strerror(errno));
+            }
+            return;
+        }
+
+        if(server->connections.size() >= maxConnections) {
+            log_error_limited("stream connection limit of %ld reached", maxConnections);
+            ::close(fd);
+            continue;
+        }
+
+        if(l->tcp) {
+            // replies are already coalesced per read, do not hold them back
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+
+        auto conn = new connection();
+        conn->server = server;
+        conn->fd = fd;
+        conn->txOffset = 0;
+        conn->events = EPOLLIN;
+        conn->finished = false;
+        if(!server->loop->addHandler(fd, EPOLLIN, onConnection, conn)) {
+            ::close(fd);
+            delete conn;
+            continue;
+        }
+        server->connections[fd] = conn;
+    }
+}
+
+bool StreamServer::process(connection *conn) {
+    size_t pos = 0;
+
+    // answer every complete frame, in order, until the write buffer backs up
+    while(conn->rx.size() - pos >= 4 && conn->tx.size() - conn->txOffset < highWater) {
+        auto p = (const uint8_t *) conn->rx.data() + pos;
+        size_t len = ((size_t)p[0] << 24) | ((size_t)p[1] << 16) | ((size_t)p[2] << 8) | (size_t)p[3];
+        if(len > maxFrame) {
+            log_error_limited("stream request of %ld bytes exceeds %ld, closing connection", len, maxFrame);
+            return false;
+        }
+        if(conn->rx.size() - pos - 4 < len) break;
+
+        auto &request = decoder.decode(conn->rx.data() + pos + 4, len, nullptr);
+        (*handler)(request, response);
+
+        char header[4] = {
+            (char) (response.size() >> 24),
+            (char) (response.size() >> 16),
+            (char) (response.size() >> 8),
+            (char) response.size()
+        };
+        conn->tx.append(header, sizeof(header));
+        conn->tx.append(response);
+        pos += 4 + len;
+    }
+
+    conn->rx.erase(0, pos);
+    return true;
+}
+
+bool StreamServer::flush(connection *conn) {
+    while(conn->txOffset < conn->tx.size()) {
+        auto rs = send(conn->fd, conn->tx.data() + conn->txOffset, conn->tx.size() - conn->txOffset,
+                       MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(rs < 0) {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return false;
+        }
+        conn->txOffset += rs;
+    }
+
+    if(conn->txOffset == conn->tx.size()) {
+        conn->tx.clear();
+        conn->txOffset = 0;
+    }
+    else if(conn->txOffset >= highWater) {
+        conn->tx.erase(0, conn->txOffset);
+        conn->txOffset = 0;
+    }
+    return true;
+}
+
+void StreamServer::update(connection *conn) {
+    uint32_t events = 0;
+    if(!conn->finished && conn->tx.size() - conn->txOffset < highWater && conn->rx.size() < highWater) {
+        events |= EPOLLIN;
+    }
+    if(conn->txOffset < conn->tx.size()) {
+        events |= EPOLLOUT;
+    }
+    if(events != conn->events) {
+        conn->events = events;
+        loop->modifyHandler(conn->fd, events);
+    }
+}
+
+void StreamServer::onConnection(void *context, uint32_t events) {
+    auto conn = (connection *) context;
+    auto server = conn->server;
+
+    if(!conn->finished && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        char temp[16384];
+        while(conn->rx.size() < highWater) {
+            auto rs = recv(conn->fd, temp, sizeof(temp), MSG_DONTWAIT);
+            if(rs > 0) {
+                conn->rx.append(temp, (size_t)rs);
+                continue;
+            }
+            if(rs == 0) {
+                conn->finished = true;
+            }
+            else if(errno == EINTR) {
+                continue;
+            }
+            else if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                server->close(conn);
+                return;
+            }
+            break;
+        }
+    }
+
+    // make room first, then answer requests in batches with one write per batch;
+    // keep going while the socket takes everything, held back requests included
+    if(!server->flush(conn)) {
+        server->close(conn);
+        return;
+    }
+
+    size_t pending;
+    do {
+        pending = conn->rx.size();
+        if(!server->process(conn) || !server->flush(conn)) {
+            server->close(conn);
+            return;
+        }
+    } while(conn->rx.size() != pending && conn->txOffset == conn->tx.size());
+
+    // replies still owed to a half-closed peer are written out before closing
+    if(conn->finished && conn->txOffset == conn->tx.size()) {
+        server->close(conn);
+        return;
+    }
+    server->update(conn);
+}
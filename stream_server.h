@@ -0,0 +1,73 @@
+#ifndef LUTRON_INTEGRATION_STREAM_SERVER_H
+#define LUTRON_INTEGRATION_STREAM_SERVER_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <netinet/in.h>
+#include "event_loop.h"
+#include "service_request.h"
+
+/**
+ * Stream transport for the service API on TCP and/or a unix domain socket.
+ * Every request and reply is framed by a 32-bit big-endian length. Clients may
+ * pipeline any number of requests; replies are queued in order on a
+ * per-connection write buffer, and a connection stops being read while that
+ * buffer is above its high water mark.
+ *
+ * Requests carry no datagram endpoint, so `subscribe` is answered with an
+ * error here; change notifications are only pushed over UDP.
+ */
+class StreamServer {
+public:
+    static const size_t maxFrame = 65536;
+    static const size_t highWater = 262144;
+    static const size_t maxConnections = 256;
+
+private:
+    struct listener {
+        StreamServer *server;
+        int fd;
+        bool tcp;
+    };
+
+    struct connection {
+        StreamServer *server;
+        int fd;
+        std::string rx;
+        std::string tx;
+        size_t txOffset;
+        uint32_t events;
+        bool finished;      // peer closed its side, flush and close
+    };
+
+    service_handler_t handler;
+    EventLoop *loop;
+    service_decoder decoder;
+    std::string response;
+    std::string unixPath;
+    std::vector<listener *> listeners;
+    std::map<int, connection *> connections;
+
+    bool listenOn(int fd, const sockaddr *addr, socklen_t len, bool tcp);
+    bool process(connection *conn);
+    bool flush(connection *conn);
+    void update(connection *conn);
+    void close(connection *conn);
+
+    static void onAccept(void *context, uint32_t events);
+    static void onConnection(void *context, uint32_t events);
+
+public:
+    explicit StreamServer(service_handler_t handler);
+    ~StreamServer();
+
+    bool listenTcp(const sockaddr_in &addr);
+    bool listenUnix(const char *path);
+
+    bool attach(EventLoop *loop);
+    void stop();
+};
+
+
+#endif //LUTRON_INTEGRATION_STREAM_SERVER_H
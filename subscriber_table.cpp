@@ -0,0 +1,103 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include "subscriber_table.h"
+#include "event_loop.h"
+#include "logging.h"
+
+static const uint64_t nanosPerSecond = 1000000000ull;
+
+subscriber_table::subscriber_table() :
+    mutexTable(PTHREAD_MUTEX_INITIALIZER)
+{
+    sockfd = -1;
+}
+
+void subscriber_table::expire(uint64_t now) {
+    auto it = std::remove_if(list.begin(), list.end(), [now](const subscriber &s) {
+        return s.expires <= now;
+    });
+    list.erase(it, list.end());
+}
+
+static bool sameEndpoint(const sockaddr_in &a, const sockaddr_in &b) {
+    return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+}
+
+int subscriber_table::subscribe(const sockaddr_in &address, int ttl, bool filtered, const std::vector<int> &ids) {
+    if(ttl > max_ttl) ttl = max_ttl;
+    if(ttl < 0) ttl = 0;
+
+    auto now = EventLoop::now();
+    pthread_mutex_lock(&mutexTable);
+    expire(now);
+
+    auto it = std::find_if(list.begin(), list.end(), [&address](const subscriber &s) {
+        return sameEndpoint(s.address, address);
+    });
+
+    if(ttl == 0) {
+        if(it != list.end()) {
+            list.erase(it);
+        }
+    }
+    else {
+        if(it == list.end()) {
+            if(list.size() >= max_subscribers) {
+                pthread_mutex_unlock(&mutexTable);
+                log_error_limited("subscriber limit of %d reached", max_subscribers);
+                return -1;
+            }
+            list.push_back(subscriber());
+            it = list.end() - 1;
+            it->address = address;
+        }
+
+        it->expires = now + (uint64_t)ttl * nanosPerSecond;
+        it->filtered = filtered;
+        it->ids = ids;
+        std::sort(it->ids.begin(), it->ids.end());
+    }
+
+    pthread_mutex_unlock(&mutexTable);
+    return ttl;
+}
+
+void subscriber_table::publish(int id, const char *data, size_t len) {
+    if(sockfd < 0) return;
+
+    auto now = EventLoop::now();
+    pthread_mutex_lock(&mutexTable);
+    expire(now);
+
+    // one datagram per subscriber, all handed to the kernel in one call
+    unsigned count = 0;
+    for(auto &s : list) {
+        if(s.filtered && !std::binary_search(s.ids.begin(), s.ids.end(), id)) continue;
+
+        iov[count].iov_base = (void *) data;
+        iov[count].iov_len = len;
+        bzero(&msgs[count], sizeof(msgs[count]));
+        msgs[count].msg_hdr.msg_name = &s.address;
+        msgs[count].msg_hdr.msg_namelen = sizeof(s.address);
+        msgs[count].msg_hdr.msg_iov = &iov[count];
+        msgs[count].msg_hdr.msg_iovlen = 1;
+        count++;
+    }
+
+    unsigned sent = 0;
+    while(sent < count) {
+        int rs = sendmmsg(sockfd, msgs + sent, count - sent, MSG_DONTWAIT);
+        if(rs < 0) {
+            if(errno == EINTR) continue;
+            // notifications that do not fit the socket buffer are dropped, the leases stay
+            if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+            log_error_limited("notification sendmmsg() failed: %s", strerror(errno));
+            sent++;
+            continue;
+        }
+        sent += rs;
+    }
+
+    pthread_mutex_unlock(&mutexTable);
+}
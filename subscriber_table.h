@@ -0,0 +1,55 @@
+#ifndef LUTRON_INTEGRATION_SUBSCRIBER_TABLE_H
+#define LUTRON_INTEGRATION_SUBSCRIBER_TABLE_H
+
+#include <cstdint>
+#include <vector>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+/**
+ * Service clients that asked to be told about state changes. Each entry is a
+ * UDP endpoint with a lease; clients renew by subscribing again before it runs
+ * out and expired entries are dropped whenever the table is touched.
+ * Subscriptions come in on any worker thread, publishing happens on the loop
+ * that receives bridge messages.
+ */
+class subscriber_table {
+public:
+    static const int max_subscribers = 64;
+    static const int default_ttl = 60;
+    static const int max_ttl = 3600;
+
+private:
+    struct subscriber {
+        sockaddr_in address;
+        uint64_t expires;
+        std::vector<int> ids;   // sorted, only consulted when filtered
+        bool filtered;          // false for every device
+    };
+
+    pthread_mutex_t mutexTable;
+    int sockfd;
+    std::vector<subscriber> list;
+
+    iovec iov[max_subscribers];
+    mmsghdr msgs[max_subscribers];
+
+    void expire(uint64_t now);
+
+public:
+    subscriber_table();
+    ~subscriber_table() = default;
+
+    // notifications go out from the service socket so they come from the service port
+    void setSocket(int fd) { sockfd = fd; }
+
+    // adds or renews the lease for `address`, a ttl of 0 removes it; returns the granted ttl
+    int subscribe(const sockaddr_in &address, int ttl, bool filtered, const std::vector<int> &ids);
+
+    // sends `data` to every live subscriber interested in device `id`
+    void publish(int id, const char *data, size_t len);
+};
+
+
+#endif //LUTRON_INTEGRATION_SUBSCRIBER_TABLE_H
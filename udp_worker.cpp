@@ -0,0 +1,146 @@
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include "udp_worker.h"
+#include "logging.h"
+
+UdpWorker::UdpWorker(service_handler_t h) :
+    thread{}
+{
+    sockfd = -1;
+    handler = h;
+    loop = nullptr;
+    ownLoop = nullptr;
+}
+
+UdpWorker::~UdpWorker() {
+    stop();
+    if(sockfd >= 0) {
+        close(sockfd);
+    }
+}
+
+bool UdpWorker::bind(const sockaddr_in &addr, bool reusePort) {
+    sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(sockfd < 0) {
+        log_error("failed to create socket");
+        return false;
+    }
+
+    int one = 1;
+    if(reusePort && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        log_error("failed to set SO_REUSEPORT: %s", strerror(errno));
+        close(sockfd);
+        sockfd = -1;
+        return false;
+    }
+
+    if (::bind(sockfd, (const struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        log_error("ERROR on socket binding! %s (%d)", strerror(errno), errno);
+        close(sockfd);
+        sockfd = -1;
+        return false;
+    }
+    return true;
+}
+
+bool UdpWorker::attach(EventLoop *evloop) {
+    loop = evloop;
+    return loop->addHandler(sockfd, EPOLLIN, onReadable, this);
+}
+
+bool UdpWorker::start() {
+    ownLoop = new EventLoop();
+    if(!attach(ownLoop)) {
+        return false;
+    }
+    if(pthread_create(&thread, nullptr, doThread, this) != 0) {
+        ownLoop->removeHandler(sockfd);
+        delete ownLoop;
+        ownLoop = nullptr;
+        loop = nullptr;
+        return false;
+    }
+    return true;
+}
+
+void UdpWorker::stop() {
+    if(ownLoop) {
+        ownLoop->stop();
+        pthread_join(thread, nullptr);
+        ownLoop->removeHandler(sockfd);
+        delete ownLoop;
+        ownLoop = nullptr;
+    }
+    else if(loop) {
+        loop->removeHandler(sockfd);
+    }
+    loop = nullptr;
+}
+
+void * UdpWorker::doThread(void *context) {
+    auto ctx = (UdpWorker *) context;
+    ctx->loop->run();
+    return nullptr;
+}
+
+void UdpWorker::onReadable(void *context, uint32_t events) {
+    auto ctx = (UdpWorker *) context;
+
+    // drain every pending datagram in batches, the socket is non-blocking
+    for(;;) {
+        for(int i = 0; i < batchSize; i++) {
+            ctx->rxIov[i].iov_base = ctx->buffers[i];
+            ctx->rxIov[i].iov_len = sizeof(ctx->buffers[i]);
+            bzero(&ctx->rxMsgs[i], sizeof(ctx->rxMsgs[i]));
+            ctx->rxMsgs[i].msg_hdr.msg_name = &ctx->remoteAddrs[i];
+            ctx->rxMsgs[i].msg_hdr.msg_namelen = sizeof(ctx->remoteAddrs[i]);
+            ctx->rxMsgs[i].msg_hdr.msg_iov = &ctx->rxIov[i];
+            ctx->rxMsgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int count = recvmmsg(ctx->sockfd, ctx->rxMsgs, batchSize, MSG_DONTWAIT, nullptr);
+        if(count < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_error_limited("udp recvmmsg() failed: %s", strerror(errno));
+            }
+            break;
+        }
+
+        int replies = 0;
+        for(int i = 0; i < count; i++) {
+            if(ctx->rxMsgs[i].msg_len == 0) continue;
+            if(ctx->rxMsgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                log_error_limited("udp request exceeds %d bytes, dropped", bufferSize);
+                continue;
+            }
+
+            auto &response = ctx->responses[replies];
+            auto &request = ctx->decoder.decode(ctx->buffers[i], ctx->rxMsgs[i].msg_len, &ctx->remoteAddrs[i]);
+            (*ctx->handler)(request, response);
+
+            ctx->txIov[replies].iov_base = (void *) response.data();
+            ctx->txIov[replies].iov_len = response.size();
+            bzero(&ctx->txMsgs[replies], sizeof(ctx->txMsgs[replies]));
+            ctx->txMsgs[replies].msg_hdr.msg_name = &ctx->remoteAddrs[i];
+            ctx->txMsgs[replies].msg_hdr.msg_namelen = ctx->rxMsgs[i].msg_hdr.msg_namelen;
+            ctx->txMsgs[replies].msg_hdr.msg_iov = &ctx->txIov[replies];
+            ctx->txMsgs[replies].msg_hdr.msg_iovlen = 1;
+            replies++;
+        }
+
+        // flush all replies for the batch with as few syscalls as possible
+        int sent = 0;
+        while(sent < replies) {
+            int rs = sendmmsg(ctx->sockfd, ctx->txMsgs + sent, (unsigned)(replies - sent), 0);
+            if(rs < 0) {
+                if(errno == EINTR) continue;
+                log_error_limited("udp sendmmsg() failed: %s", strerror(errno));
+                break;
+            }
+            sent += rs;
+        }
+
+        if(count < batchSize) break;
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef LUTRON_INTEGRATION_UDP_WORKER_H
+#define LUTRON_INTEGRATION_UDP_WORKER_H
+
+#include <string>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "event_loop.h"
+#include "service_request.h"
+
+/**
+ * One shard of the UDP service: a socket, a request decoder and batch buffers.
+ * Several workers bind the same port with SO_REUSEPORT and the kernel spreads
+ * clients across them. A worker either runs on an existing event loop or on
+ * its own loop in a dedicated thread.
+ */
+class UdpWorker {
+public:
+    static const int batchSize = 32;
+    static const int bufferSize = 8192;
+
+private:
+    int sockfd;
+    service_handler_t handler;
+    service_decoder decoder;
+    EventLoop *loop;
+    EventLoop *ownLoop;
+    pthread_t thread;
+
+    char buffers[batchSize][bufferSize];
+    sockaddr_in remoteAddrs[batchSize];
+    iovec rxIov[batchSize], txIov[batchSize];
+    mmsghdr rxMsgs[batchSize], txMsgs[batchSize];
+    std::string responses[batchSize];
+
+    static void onReadable(void *context, uint32_t events);
+    static void * doThread(void *context);
+
+public:
+    explicit UdpWorker(service_handler_t handler);
+    ~UdpWorker();
+
+    bool bind(const sockaddr_in &addr, bool reusePort);
+
+    // serve on an existing loop, or spawn a thread with its own loop
+    bool attach(EventLoop *loop);
+    bool start();
+    void stop();
+
+    int getSocket() const { return sockfd; }
+};
+
+
+#endif //LUTRON_INTEGRATION_UDP_WORKER_H